@@ -9,13 +9,22 @@ URL: https://github.com/scitokens/xrootd-scitokens
 # git archive v%{version} --prefix=xrootd-scitokens-%{version}/ | gzip -7 > ~/rpmbuild/SOURCES/xrootd-scitokens-%{version}.tar.gz
 Source0: %{name}-%{version}.tar.gz
 
+# Build with `--without python` for a plugin using only the native token validator.
+%bcond_without python
+# Build with `--with pgo` (and `--without python`) for a plugin optimized with
+# profile-guided and link-time optimization.
+%bcond_with pgo
+
 BuildRequires: gcc-c++
 BuildRequires: cmake
+BuildRequires: openssl-devel
+BuildRequires: xrootd-server-devel
+%if %{with python}
 BuildRequires: boost-devel
 BuildRequires: python-devel
-BuildRequires: xrootd-server-devel
 
 Requires: python2-scitokens
+%endif
 #Requires: boost-python
 
 %description
@@ -27,8 +36,13 @@ SciTokens authentication plugin for XRootD
 %build
 mkdir build
 cd build
-%cmake ..
+%cmake -DSCITOKENS_PYTHON=%{?with_python:ON}%{!?with_python:OFF} -DSCITOKENS_PGO=%{?with_pgo:ON}%{!?with_pgo:OFF} \
+       -DLIBEXEC_INSTALL_DIR=%{_libexecdir}/%{name} ..
 make 
+%if %{with pgo}
+# Report the gains of the optimized plugin over a default build in the build log.
+make scitokens-pgo-report
+%endif
 
 %install
 pushd build
@@ -48,8 +62,11 @@ rm -rf $RPM_BUILD_ROOT
 
 %files
 %{_libdir}/libXrdAccSciTokens-4.so
+%{_libexecdir}/%{name}/xrootd-scitokens-worker
+%if %{with python}
 %{_libdir}/python2.7/site-packages/_scitokens_xrootd.so
 %{_libdir}/python2.7/site-packages/scitokens_xrootd.py*
+%endif
 
 %defattr(-,root,root,-)
 
@@ -1,19 +1,42 @@
-
 #include "XrdAcc/XrdAccAuthorize.hh"
 #include "XrdOuc/XrdOucEnv.hh"
 #include "XrdSec/XrdSecEntity.hh"
+#include "XrdSys/XrdSysError.hh"
 #include "XrdSys/XrdSysLogger.hh"
 #include "XrdVersion.hh"
+#if XrdVNUMBER >= 50000
+#include "XrdSec/XrdSecEntityAttr.hh"
+#endif
 
+#ifdef SCITOKENS_PYTHON
 #include <boost/python.hpp>
+#endif
 
-#include <map>
+#include "scitokens_core.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <memory>
 #include <mutex>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#ifdef SCITOKENS_PYTHON
 #include <dlfcn.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+// Where the `worker` validation engine finds its worker program by default.
+#ifndef SCITOKENS_WORKER_PROGRAM
+#define SCITOKENS_WORKER_PROGRAM "/usr/libexec/xrootd-scitokens/xrootd-scitokens-worker"
+#endif
 
 XrdVERSIONINFO(XrdAccAuthorizeObject, XrdAccSciTokens);
 
@@ -26,6 +49,175 @@ extern XrdAccAuthorize *XrdAccDefaultAuthorizeObject(XrdSysLogger   *lp,
                                                      XrdVersionInfo &myVer);
 
 
+// The authorization core mirrors the XRootD privileges and the operations of
+// XRootD 4, so that they convert with a cast; later XRootD releases add
+// operations, which MapOp() maps explicitly.
+static constexpr bool SameValue(int left, int right) {return left == right;}
+static_assert(SameValue(SciTokensOp_Any, AOP_Any) && SameValue(SciTokensOp_Chmod, AOP_Chmod) &&
+              SameValue(SciTokensOp_Chown, AOP_Chown) && SameValue(SciTokensOp_Create, AOP_Create) &&
+              SameValue(SciTokensOp_Delete, AOP_Delete) && SameValue(SciTokensOp_Insert, AOP_Insert) &&
+              SameValue(SciTokensOp_Lock, AOP_Lock) && SameValue(SciTokensOp_Mkdir, AOP_Mkdir) &&
+              SameValue(SciTokensOp_Read, AOP_Read) && SameValue(SciTokensOp_Readdir, AOP_Readdir) &&
+              SameValue(SciTokensOp_Rename, AOP_Rename) && SameValue(SciTokensOp_Stat, AOP_Stat) &&
+              SameValue(SciTokensOp_Update, AOP_Update),
+              "SciTokensOp must match Access_Operation");
+static_assert(SameValue(SciTokensPriv_All, XrdAccPriv_All) && SameValue(SciTokensPriv_Delete, XrdAccPriv_Delete) &&
+              SameValue(SciTokensPriv_Insert, XrdAccPriv_Insert) && SameValue(SciTokensPriv_Lock, XrdAccPriv_Lock) &&
+              SameValue(SciTokensPriv_Lookup, XrdAccPriv_Lookup) &&
+              SameValue(SciTokensPriv_Rename, XrdAccPriv_Rename) && SameValue(SciTokensPriv_Read, XrdAccPriv_Read) &&
+              SameValue(SciTokensPriv_Write, XrdAccPriv_Write) && SameValue(SciTokensPriv_Chmod, XrdAccPriv_Chmod) &&
+              SameValue(SciTokensPriv_Chown, XrdAccPriv_Chown) && SameValue(SciTokensPriv_Create, XrdAccPriv_Create) &&
+              SameValue(SciTokensPriv_Mkdir, XrdAccPriv_Mkdir) &&
+              SameValue(SciTokensPriv_Readdir, XrdAccPriv_Readdir) &&
+              SameValue(SciTokensPriv_Update, XrdAccPriv_Update) && SameValue(SciTokensPriv_None, XrdAccPriv_None),
+              "SciTokensPrivs must match XrdAccPrivs");
+
+
+// The core's operation for `oper`.  Operations the core does not know are
+// mapped past SciTokensOp_Last, which no privileges permit.
+static inline int MapOp(Access_Operation oper)
+{
+#if XrdVNUMBER >= 50000
+    switch (oper) {
+    case AOP_Excl_Create: return SciTokensOp_Create;
+    case AOP_Excl_Insert: return SciTokensOp_Insert;
+    default: break;
+    }
+#endif
+    unsigned idx = static_cast<unsigned>(oper);
+    return idx <= static_cast<unsigned>(SciTokensOp_Last) ? static_cast<int>(idx) : SciTokensOp_Last + 1;
+}
+
+
+static std::string ElapsedMs(std::chrono::steady_clock::time_point start)
+{
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count());
+}
+
+
+// Forwards the messages of the authorization core to the plugin's log.
+class XrdAccSciTokensLog : public SciTokensLog
+{
+public:
+    XrdAccSciTokensLog(XrdSysError &log) : m_log(log) {}
+
+    virtual void Say(const char *text1, const char *text2, const char *text3, const char *text4,
+                     const char *text5, const char *text6)
+    {
+        m_log.Say(text1, text2, text3, text4, text5, text6);
+    }
+
+    virtual void Emsg(const char *esfx, const char *text1, const char *text2, const char *text3)
+    {
+        m_log.Emsg(esfx, text1, text2, text3);
+    }
+
+    virtual int Emsg(const char *esfx, int ecode, const char *text1, const char *text2)
+    {
+        return m_log.Emsg(esfx, ecode, text1, text2);
+    }
+
+private:
+    XrdSysError &m_log;
+};
+
+
+// A request decided by the chained authorizer, for the core's SciTokensChain.
+class XrdAccChainRequest : public SciTokensChain
+{
+public:
+    XrdAccChainRequest(XrdAccAuthorize &chain, const XrdSecEntity *Entity, const char *path,
+                       const Access_Operation oper, XrdOucEnv *env) :
+        m_chain(chain), m_entity(Entity), m_path(path), m_oper(oper), m_env(env)
+    {}
+
+    virtual SciTokensPrivs Access()
+    {
+        return static_cast<SciTokensPrivs>(m_chain.Access(m_entity, m_path, m_oper, m_env));
+    }
+
+    virtual std::string Key() const
+    {
+        return MakeKey(std::string(m_entity->prot, strnlen(m_entity->prot, sizeof(m_entity->prot))),
+                       {m_entity->name, m_entity->host, m_entity->vorg, m_entity->role, m_entity->grps},
+                       static_cast<int>(m_oper), m_path);
+    }
+
+private:
+    XrdAccAuthorize &m_chain;
+    const XrdSecEntity *m_entity;
+    const char *m_path;
+    const Access_Operation m_oper;
+    XrdOucEnv *m_env;
+};
+
+
+// Strings this plugin attaches to the fields of clients' entities.
+//
+// Once attached, a string belongs to the entity: the security protocols and
+// XrdHttp free() the entity's name and grps when the connection is cleaned up
+// or the protocol object is recycled.  Each value is therefore a malloc'd copy,
+// made only when the field does not already hold it -- once per connection and
+// token, not per request.  A field is only replaced if it still holds the copy
+// this plugin attached (same pointer, same contents); values set by the
+// security protocol are left alone.  A replaced copy is not freed, since
+// another request on the same connection may still be reading it; it leaks
+// once per token change on a connection.
+//
+// The copy attached to each field is remembered for as long as the plugin is
+// loaded: forgetting it would leave the field holding an earlier token's
+// value that looks like the security protocol's.  XRootD recycles its
+// protocol objects, and the entities within them, so this grows with the
+// peak number of connections rather than with traffic.  Protocol-set values
+// are told apart without the lock by a filter of the copies' addresses.
+class XrdAccEntityFields
+{
+public:
+    // Set `*field` to a copy of `value` (nullptr to clear it), unless the
+    // field holds a value this plugin did not attach.
+    void Attach(char **field, const char *value)
+    {
+        if (*field && value && !strcmp(*field, value)) {return;}
+        if (*field && !MaybeAttached(*field)) {return;}
+        std::lock_guard<std::mutex> guard(m_mutex);
+        auto iter = m_attached.find(field);
+        bool ours = iter != m_attached.end() && *field == iter->second.first && iter->second.second == *field;
+        if (*field && !ours) {return;}
+        char *copy = value ? strdup(value) : nullptr;
+        if (copy) {
+            size_t bit = FilterBit(copy);
+            m_filter[bit / 64].fetch_or(uint64_t(1) << (bit % 64));
+            m_attached[field] = std::make_pair(copy, std::string(value));
+        } else {
+            m_attached.erase(field);
+        }
+        *field = copy;
+    }
+
+private:
+    // Whether `ptr` may be a copy this plugin attached; never false for one.
+    bool MaybeAttached(const char *ptr) const
+    {
+        size_t bit = FilterBit(ptr);
+        return (m_filter[bit / 64].load() >> (bit % 64)) & 1;
+    }
+
+    static size_t FilterBit(const char *ptr)
+    {
+        uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+        return ((addr >> 4) ^ (addr >> 20)) % (64 * m_filter_words);
+    }
+
+    static constexpr size_t m_filter_words = 1024;
+    std::atomic<uint64_t> m_filter[m_filter_words] = {};
+    std::mutex m_mutex;
+    // The copy attached to each field, with its contents.
+    std::unordered_map<char **, std::pair<const char *, std::string>> m_attached;
+};
+
+
+#ifdef SCITOKENS_PYTHON
 static std::string
 handle_pyerror()
 {
@@ -41,121 +233,249 @@ handle_pyerror()
 }
 
 
-static inline uint64_t monotonic_time() {
-  struct timespec tp;
-#ifdef CLOCK_MONOTONIC_COARSE
-  clock_gettime(CLOCK_MONOTONIC_COARSE, &tp);
-#else
-  clock_gettime(CLOCK_MONOTONIC, &tp);
-#endif
-  return tp.tv_sec + (tp.tv_nsec >= 500000000);
-}
+// Holds the python GIL for the lifetime of the object.
+class PyGILGuard
+{
+public:
+    PyGILGuard() : m_state(PyGILState_Ensure()) {}
+    ~PyGILGuard() {PyGILState_Release(m_state);}
 
+private:
+    PyGILGuard(const PyGILGuard &) = delete;
+    PyGILGuard &operator=(const PyGILGuard &) = delete;
 
-static XrdAccPrivs AddPriv(Access_Operation op, XrdAccPrivs privs)
-{
-    int new_privs = privs;
-    switch (op) {
-        case AOP_Any:
-            break;
-        case AOP_Chmod:
-            new_privs |= static_cast<int>(XrdAccPriv_Chmod);
-            break;
-        case AOP_Chown:
-            new_privs |= static_cast<int>(XrdAccPriv_Chown);
-            break;
-        case AOP_Create:
-            new_privs |= static_cast<int>(XrdAccPriv_Create);
-            break;
-        case AOP_Delete:
-            new_privs |= static_cast<int>(XrdAccPriv_Delete);
-            break;
-        case AOP_Insert:
-            new_privs |= static_cast<int>(XrdAccPriv_Insert);
-            break;
-        case AOP_Lock:
-            new_privs |= static_cast<int>(XrdAccPriv_Lock);
-            break;
-        case AOP_Mkdir:
-            new_privs |= static_cast<int>(XrdAccPriv_Mkdir);
-            break;
-        case AOP_Read:
-            new_privs |= static_cast<int>(XrdAccPriv_Read);
-            break;
-        case AOP_Readdir:
-            new_privs |= static_cast<int>(XrdAccPriv_Readdir);
-            break;
-        case AOP_Rename:
-            new_privs |= static_cast<int>(XrdAccPriv_Rename);
-            break;
-        case AOP_Stat:
-            new_privs |= static_cast<int>(XrdAccPriv_Lookup);
-            break;
-        case AOP_Update:
-            new_privs |= static_cast<int>(XrdAccPriv_Update);
-            break;
-    };
-    return static_cast<XrdAccPrivs>(new_privs);
-}
+    PyGILState_STATE m_state;
+};
 
-class XrdAccRules
+
+// Validates tokens with the python module.  Python is initialized on the
+// first validation; the GIL is only held while calling into it.
+//
+// Concurrent validations are batched: the first thread to arrive collects
+// the tokens of the threads arriving while it waits for the GIL (and, if
+// another batch is already in python, for `batch_window_us` more) and
+// validates them all with one call to generate_acls_batch().
+class XrdAccPythonValidator : public SciTokensValidator
 {
 public:
-    XrdAccRules(uint64_t expiry_time, const std::string &username) :
-        m_expiry_time(expiry_time),
-        m_username(username)
+    XrdAccPythonValidator(XrdSysError &log, unsigned batch_window_us) :
+        m_log(log),
+        m_batch_window(batch_window_us)
     {}
 
-    ~XrdAccRules() {}
+    virtual ~XrdAccPythonValidator() {
+        if (m_module) {
+            PyGILGuard gil;
+            m_module.reset();
+        }
+    }
 
-    XrdAccPrivs apply(Access_Operation, std::string path) {
-        XrdAccPrivs privs = XrdAccPriv_None;
-        for (const auto & rule : m_rules) {
-            if (!path.compare(0, rule.second.size(), rule.second, 0, rule.second.size())) {
-                privs = AddPriv(rule.first, privs);
-            }
+    virtual const char *Name() const {return "python";}
+
+    virtual bool Init(const SciTokensIssuerTable &issuers, SciTokensLog &)
+    {
+        m_issuers = &issuers;
+        return true;
+    }
+
+    virtual bool Validate(const char *authz, SciTokensInfo &info)
+    {
+        if (!InitPython()) {return false;}
+        Request request(authz, &info);
+        std::unique_lock<std::mutex> lock(m_batch_mutex);
+        m_pending.push_back(&request);
+        if (m_collecting) {
+            m_batch_cond.wait(lock, [&request]() {return request.m_done;});
+            return request.m_valid;
+        }
+        m_collecting = true;
+        bool busy = m_running > 0;
+        lock.unlock();
+        if (busy) {
+            std::this_thread::sleep_for(m_batch_window);
+        }
+
+        std::vector<Request *> batch;
+        {
+            PyGILGuard gil;
+            lock.lock();
+            batch.swap(m_pending);
+            m_collecting = false;
+            m_running++;
+            lock.unlock();
+            ValidateBatch(batch);
+        }
+
+        lock.lock();
+        m_running--;
+        for (auto entry : batch) {
+            entry->m_done = true;
         }
-        return privs;
+        lock.unlock();
+        m_batch_cond.notify_all();
+        return request.m_valid;
     }
 
-    bool expired() const {return monotonic_time() > m_expiry_time;}
+private:
+    struct Request
+    {
+        Request(const char *authz, SciTokensInfo *info) : m_authz(authz), m_info(info) {}
 
-    void parse(boost::python::list results) {
-        int cache_len = boost::python::len(results);
-        for (int idx=0; idx<cache_len; idx++) {
-            boost::python::object entry = results[idx];
-            Access_Operation aop = boost::python::extract<Access_Operation>(entry[0]);
-            std::string path = boost::python::extract<std::string>(entry[1]);
-            m_rules.emplace_back(aop, path);
+        const char *m_authz;
+        SciTokensInfo *m_info;
+        bool m_valid{false};
+        bool m_done{false};
+    };
+
+    // Validate the tokens of `batch` in one call into python; the GIL must be held.
+    void ValidateBatch(const std::vector<Request *> &batch)
+    {
+        try {
+            boost::python::list headers;
+            for (const auto entry : batch) {
+                headers.append(entry->m_authz);
+            }
+            boost::python::object results = m_module->attr("generate_acls_batch")(headers);
+            for (size_t idx = 0; idx < batch.size(); idx++) {
+                boost::python::object retval = results[idx];
+                boost::python::extract<std::string> error(retval);
+                if (error.check()) {
+                    m_log.Emsg("Access", "Error generating ACLs for authorization", error().c_str());
+                } else {
+                    ExtractInfo(retval, *batch[idx]->m_info);
+                    batch[idx]->m_valid = true;
+                }
+            }
+        } catch (boost::python::error_already_set) {
+            m_log.Emsg("Access", "Error generating ACLs for authorization", handle_pyerror().c_str());
+            for (auto entry : batch) {
+                entry->m_valid = false;
+            }
         }
     }
 
-    const std::string & get_username() const {return m_username;}
+    // Convert a generate_acls() result; throws error_already_set.
+    static void ExtractInfo(const boost::python::object &retval, SciTokensInfo &info)
+    {
+        info.m_expiry = boost::python::extract<uint64_t>(retval[0]);
+        boost::python::list acls = boost::python::list(retval[1]);
+        for (int idx = 0; idx < boost::python::len(acls); idx++) {
+            boost::python::object entry = acls[idx];
+            Access_Operation aop = boost::python::extract<Access_Operation>(entry[0]);
+            std::string acl_path = boost::python::extract<std::string>(entry[1]);
+            info.m_acls.emplace_back(static_cast<SciTokensOp>(aop), acl_path);
+        }
+        info.m_username = boost::python::extract<std::string>(retval[2]);
+        info.m_issuer = boost::python::extract<std::string>(retval[3]);
+        info.m_subject = boost::python::extract<std::string>(retval[4]);
+        boost::python::list groups = boost::python::list(retval[5]);
+        for (int idx = 0; idx < boost::python::len(groups); idx++) {
+            info.m_groups.emplace_back(boost::python::extract<std::string>(groups[idx]));
+        }
+    }
 
 private:
-    std::vector<std::pair<Access_Operation, std::string>> m_rules;
-    uint64_t m_expiry_time{0};
-    const std::string m_username;
+    // Start the embedded interpreter and import the python module; done
+    // once, when the first token needs validation, rather than at startup.
+    bool InitPython()
+    {
+        std::call_once(m_python_once, [this]() {
+            auto start = std::chrono::steady_clock::now();
+            if (!Py_IsInitialized()) {
+                char pname[] = "xrootd";
+                Py_SetProgramName(pname);
+                Py_InitializeEx(0);
+                PyEval_InitThreads();
+                // Release the GIL taken by the initialization; calls into
+                // python acquire it through PyGILGuard.
+                PyEval_SaveThread();
+            }
+            // We need to reload the current shared library:
+            //   - RTLD_GLOBAL instructs the loader to put everything into the global symbol table.  Python
+            //     requires this for several modules.
+            //   - RTLD_NOLOAD instructs the loader to actually reload instead of doing an initial load.
+            //   - RTLD_NODELETE instructs the loader to not unload this library -- we need python kept in
+            //     memory!
+            void *handle = dlopen("libXrdAccSciTokens-4.so", RTLD_GLOBAL|RTLD_NODELETE|RTLD_NOLOAD|RTLD_LAZY);
+            if (handle == nullptr) {
+                m_log.Emsg("XrdAccSciTokens", "Failed to reload python libraries:", dlerror());
+                return;
+            }
+            dlclose(handle);  // Per use of RTLD_NODELETE|RTLD_NOLOAD, does not actually unload this library!
+
+            PyGILGuard gil;
+            try {
+                std::unique_ptr<boost::python::object> module(
+                    new boost::python::object(boost::python::import("scitokens_xrootd")));
+                boost::python::dict issuers;
+                for (const auto &issuer : m_issuers->issuers()) {
+                    boost::python::dict issuer_info;
+                    issuer_info["base_path"] = issuer.m_base_path;
+                    issuer_info["map_subject"] = issuer.m_map_subject;
+                    issuers[issuer.m_issuer] = issuer_info;
+                }
+                module->attr("init")(issuers);
+                m_module = std::move(module);
+            } catch (boost::python::error_already_set) {
+                m_log.Emsg("XrdAccSciTokens", "Python failure initializing module:", handle_pyerror().c_str());
+                return;
+            }
+            m_log.Say("Finished python module initialization in ", ElapsedMs(start).c_str(), " ms.");
+        });
+        return static_cast<bool>(m_module);
+    }
+
+    const SciTokensIssuerTable *m_issuers{nullptr};
+    XrdSysError &m_log;
+    std::once_flag m_python_once;
+    std::unique_ptr<boost::python::object> m_module;
+    std::chrono::microseconds m_batch_window;
+    std::mutex m_batch_mutex;
+    std::condition_variable m_batch_cond;
+    // The requests collected for the next batch; m_collecting is set while
+    // a thread is collecting them.
+    std::vector<Request *> m_pending;
+    bool m_collecting{false};
+    // The number of batches being validated.
+    unsigned m_running{0};
 };
+#endif
+
 
 class XrdAccSciTokens : public XrdAccAuthorize
 {
 public:
     XrdAccSciTokens(XrdSysLogger *lp, const char *parms, std::unique_ptr<XrdAccAuthorize> chain) :
-        m_module(boost::python::import("scitokens_xrootd")),
-        m_chain(std::move(chain)),
-        m_next_clean(monotonic_time() + m_expiry_secs),
-        m_log(lp, "scitokens_")
+        m_log(lp, "scitokens_"),
+        m_core_log(m_log),
+        m_core(m_core_log),
+        m_chain(std::move(chain))
     {
-        m_log.Say("++++++ XrdAccSciTokens: Initialized SciTokens-based authorization.");
-        if (parms) {
-            m_log.Say("Initializing python module with params ", parms);
-            m_module.attr("init")(parms);
-        } else {
-            m_log.Say("Initializing python module with no configuration parameters");
-            m_module.attr("init")();
+        auto start = std::chrono::steady_clock::now();
+        Config(parms);
+        std::unique_ptr<SciTokensValidator> validator = MakeValidator(m_engine);
+        if (!validator) {
+            throw std::runtime_error("Unknown or unavailable validation engine " + m_engine);
+        }
+        m_core.SetValidator(std::move(validator));
+        if (!m_shadow_engine.empty()) {
+            std::unique_ptr<SciTokensValidator> shadow = MakeValidator(m_shadow_engine);
+            if (!shadow) {
+                throw std::runtime_error("Unknown or unavailable shadow validation engine " + m_shadow_engine);
+            }
+            m_core.SetShadow(std::move(shadow), m_shadow_fraction);
+        }
+        m_core.SetValidationPool(m_validation_threads, m_validation_deadline_ms);
+        if (!m_core.Config(m_config_file)) {
+            throw std::runtime_error("Failed to configure token authorization from " + m_config_file);
+        }
+        m_log.Say("++++++ XrdAccSciTokens: Initialized SciTokens-based authorization in ",
+                  ElapsedMs(start).c_str(), " ms using the ", m_engine.c_str(), " validation engine.");
+#ifdef SCITOKENS_PYTHON
+        if (m_engine == "python") {
+            m_log.Say("Python initialization is deferred until a token needs validation.");
         }
-        m_log.Say("Finished python module initialization.");
+#endif
     }
 
     virtual ~XrdAccSciTokens() {}
@@ -167,42 +487,17 @@ public:
     {
         const char *authz = env->Get("authz");
         if (authz == nullptr) {
-            return m_chain ? m_chain->Access(Entity, path, oper, env) : XrdAccPriv_None;
-        }
-        std::shared_ptr<XrdAccRules> access_rules;
-        uint64_t now = monotonic_time();
-        Check(now);
-        {
-            std::lock_guard<std::mutex> guard(m_mutex);
-            const auto iter = m_map.find(authz);
-            if (iter != m_map.end() && !iter->second->expired()) {
-                access_rules = iter->second;
-            }
+            return Chain(Entity, path, oper, env);
         }
+        bool rebound = false;
+        std::shared_ptr<SciTokensRules> access_rules = m_core.Lookup(Entity, authz, rebound);
         if (!access_rules) {
-            try {
-                boost::python::object retval = m_module.attr("generate_acls")(authz);
-                boost::python::list cache = boost::python::list(retval[1]);
-                std::string username = boost::python::extract<std::string>(retval[2]);
-                //m_log.Emsg("Access", "SciTokens library returned suggested username", username.c_str());
-                uint64_t cache_expiry = boost::python::extract<uint64_t>(retval[0]);
-                access_rules.reset(new XrdAccRules(now + cache_expiry, username));
-                access_rules->parse(cache);
-            } catch (boost::python::error_already_set) {
-                m_log.Emsg("Access", "Error generating ACLs for authorization", handle_pyerror().c_str());
-                return m_chain ? m_chain->Access(Entity, path, oper, env) : XrdAccPriv_None;
-            }
-            {
-                std::lock_guard<std::mutex> guard(m_mutex);
-                m_map[authz] = access_rules;
-            }
+            return Chain(Entity, path, oper, env);
         }
-        const std::string &username = access_rules->get_username();
-        if (!username.empty() && !Entity->name) {
-            const_cast<XrdSecEntity*>(Entity)->name = strdup(username.c_str());
-        }
-        XrdAccPrivs result = access_rules->apply(oper, path);
-        return ((result == XrdAccPriv_None) && m_chain) ? m_chain->Access(Entity, path, oper, env) : result;
+        Decorate(Entity, *access_rules, rebound);
+        XrdAccPrivs result = static_cast<XrdAccPrivs>(access_rules->apply(static_cast<SciTokensOp>(MapOp(oper)),
+                                                                          path));
+        return (result == XrdAccPriv_None) ? Chain(Entity, path, oper, env, access_rules.get()) : result;
     }
 
     virtual int Audit(const int              accok,
@@ -217,30 +512,139 @@ public:
     virtual int         Test(const XrdAccPrivs priv,
                              const Access_Operation oper)
     {
-        return 0;
+        return OpPermitted(priv, MapOp(oper));
     }
 
 private:
 
-    void Check(uint64_t now)
+    // Defer to the chained authorizer, unless the path belongs to the
+    // namespace of an authoritative issuer; there, the token is the only
+    // source of authorization.  When `rules` is given, the decision is cached
+    // with the token's rules if the chain cache is enabled.
+    XrdAccPrivs Chain(const XrdSecEntity *Entity, const char *path, const Access_Operation oper, XrdOucEnv *env,
+                      SciTokensRules *rules=nullptr)
     {
-        if (now <= m_next_clean) {return;}
+        if (!m_chain) {
+            return XrdAccPriv_None;
+        }
+        XrdAccChainRequest request(*m_chain, Entity, path, oper, env);
+        return static_cast<XrdAccPrivs>(m_core.Chain(request, path, rules));
+    }
+
+    // Create the validation engine named by the `engine` or `shadow`
+    // parameter; null if it is unknown or not built.
+    std::unique_ptr<SciTokensValidator> MakeValidator(const std::string &engine)
+    {
+#ifdef SCITOKENS_PYTHON
+        if (engine == "python") {
+            return std::unique_ptr<SciTokensValidator>(new XrdAccPythonValidator(m_log, m_python_batch_window_us));
+        }
+#endif
+        return SciTokensValidator::Make(engine, m_worker_program, m_config_file, m_workers);
+    }
+
+    // Parse the plugin parameters.
+    void Config(const char *parms)
+    {
+        if (!parms) {return;}
+        std::istringstream parm_stream(parms);
+        std::string parm;
+        while (parm_stream >> parm) {
+            auto pos = parm.find('=');
+            if (pos == std::string::npos) {continue;}
+            std::string key = parm.substr(0, pos), val = parm.substr(pos + 1);
+            if (key == "config") {
+                m_config_file = val;
+            } else if (key == "resolve_identity") {
+                bool resolve_identity = (val == "true" || val == "True" || val == "1" || val == "yes");
+#if XrdVNUMBER >= 50000
+                m_core.SetResolveIdentity(resolve_identity);
+                m_log.Say("Resolving mapped usernames to Unix identities: ", resolve_identity ? "yes" : "no");
+#else
+                // The resolved identity is only exported as entity attributes,
+                // which XRootD 4 lacks; skip the NSS lookups nobody would read.
+                if (resolve_identity) {
+                    m_log.Emsg("Config", "resolve_identity requires XRootD 5 entity attributes; ignoring it");
+                }
+#endif
+            } else if (key == "engine") {
+                m_engine = val;
+            } else if (key == "shadow") {
+                m_shadow_engine = val;
+            } else if (key == "shadow_fraction") {
+                m_shadow_fraction = strtod(val.c_str(), nullptr);
+            } else if (key == "worker") {
+                m_worker_program = val;
+            } else if (key == "workers") {
+                m_workers = strtoul(val.c_str(), nullptr, 10);
+            } else if (key == "validation_threads") {
+                m_validation_threads = strtoul(val.c_str(), nullptr, 10);
+            } else if (key == "validation_deadline") {
+                m_validation_deadline_ms = strtoul(val.c_str(), nullptr, 10);
+            } else if (key == "python_batch_window") {
+                m_python_batch_window_us = strtoul(val.c_str(), nullptr, 10);
+            } else if (key == "chain_cache") {
+                size_t chain_cache_size = strtoul(val.c_str(), nullptr, 10);
+                m_core.SetChainCache(chain_cache_size);
+                m_log.Say("Caching up to ", std::to_string(chain_cache_size).c_str(),
+                          " chained authorization decisions per token");
+            }
+        }
+    }
+
 
-        for (auto iter = m_map.begin(); iter != m_map.end(); iter++) {
-            if (iter->second->expired()) {
-                m_map.erase(iter);
+    // Export the token's identity on the client's entity.  This is decided
+    // from the entity's own state rather than from the connection's binding:
+    // XrdHttp recycles its protocol objects, so a new connection may present
+    // the same token at the same address with an entity that was reset.  Most
+    // requests find the entity already carrying the token's values.  When the
+    // connection presents another token (`rebound`), values attached for the
+    // earlier token that this one lacks are cleared.  The group list is only
+    // set for issuers with `map_groups`, as the chained authorizer grants by it.
+    void Decorate(const XrdSecEntity *Entity, const SciTokensRules &rules, bool rebound)
+    {
+        XrdSecEntity *entity = const_cast<XrdSecEntity *>(Entity);
+        const char *username = rules.get_username();
+        if (username ? (!entity->name || strcmp(entity->name, username)) : (rebound && entity->name)) {
+            m_entity_fields.Attach(&entity->name, username);
+        }
+        const char *groups = rules.get_mapped_groups();
+        if (groups ? (!entity->grps || strcmp(entity->grps, groups)) : (rebound && entity->grps)) {
+            m_entity_fields.Attach(&entity->grps, groups);
+        }
+#if XrdVNUMBER >= 50000
+        if (!entity->eaAPI) {return;}
+        std::string issuer;
+        if (!rebound && entity->eaAPI->Get("scitokens.iss", issuer) && issuer == rules.get_issuer()) {return;}
+        for (const char *key : {"scitokens.iss", "scitokens.sub", "scitokens.groups", "scitokens.uid",
+                                "scitokens.gid", "scitokens.gids"}) {
+            std::string value;
+            for (const auto &attr : rules.get_attributes()) {
+                if (attr.first == key) {value = attr.second;}
             }
+            entity->eaAPI->Add(key, value, true);
         }
+#endif
     }
 
-    std::mutex m_mutex;
-    std::map<std::string, std::shared_ptr<XrdAccRules>> m_map;
-    boost::python::object m_module;
-    std::unique_ptr<XrdAccAuthorize> m_chain;
-    uint64_t m_next_clean{0};
     XrdSysError m_log;
-
-    static constexpr uint64_t m_expiry_secs = 60;
+    XrdAccSciTokensLog m_core_log;
+    SciTokensAuthorizer m_core;
+    XrdAccEntityFields m_entity_fields;
+    std::unique_ptr<XrdAccAuthorize> m_chain;
+    std::string m_config_file{"/etc/xrootd/scitokens.cfg"};
+#ifdef SCITOKENS_PYTHON
+    std::string m_engine{"python"};
+#else
+    std::string m_engine{"native"};
+#endif
+    std::string m_shadow_engine;
+    double m_shadow_fraction{0.1};
+    std::string m_worker_program{SCITOKENS_WORKER_PROGRAM};
+    unsigned m_workers{2};
+    unsigned m_validation_threads{std::max(std::thread::hardware_concurrency(), 1u)};
+    unsigned m_validation_deadline_ms{1000};
+    unsigned m_python_batch_window_us{200};
 };
 
 extern "C" {
@@ -249,34 +653,13 @@ XrdAccAuthorize *XrdAccAuthorizeObject(XrdSysLogger *lp,
                                        const char   *cfn,
                                        const char   *parm)
 {
-    // First, try to initialize the embedded python.
-    if (!Py_IsInitialized())
-    {
-        char pname[] = "xrootd";
-        Py_SetProgramName(pname);
-        Py_InitializeEx(0);
-    }
-    // We need to reload the current shared library:
-    //   - RTLD_GLOBAL instructs the loader to put everything into the global symbol table.  Python
-    //     requires this for several modules.
-    //   - RTLD_NOLOAD instructs the loader to actually reload instead of doing an initial load.
-    //   - RTLD_NODELETE instructs the loader to not unload this library -- we need python kept in
-    //     memory!
-    void *handle = dlopen("libXrdAccSciTokens-4.so", RTLD_GLOBAL|RTLD_NODELETE|RTLD_NOLOAD|RTLD_LAZY);
-    if (handle == nullptr) {
-        XrdSysError eDest(lp, "scitokens_");
-        eDest.Emsg("XrdAccSciTokens", "Failed to reload python libraries:", dlerror());
-        return nullptr;
-    }
-    dlclose(handle);  // Per use of RTLD_NODELETE|RTLD_NOLOAD, does not actually unload this library!
-
     std::unique_ptr<XrdAccAuthorize> def_authz(XrdAccDefaultAuthorizeObject(lp, cfn, parm, compiledVer));
     XrdAccSciTokens *authz{nullptr};
     try {
         authz = new XrdAccSciTokens(lp, parm, std::move(def_authz));
-    } catch (boost::python::error_already_set) {
+    } catch (std::exception &exc) {
         XrdSysError eDest(lp, "scitokens_");
-        eDest.Emsg("XrdAccSciTokens", "Python failure initializing module:", handle_pyerror().c_str());
+        eDest.Emsg("XrdAccSciTokens", "Failure initializing module:", exc.what());
     }
     return authz;
 }
@@ -0,0 +1,1734 @@
+#include "scitokens_core.h"
+#include "scitokens_parse.h"
+
+#include <openssl/bn.h>
+#include <openssl/ecdsa.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include <ctype.h>
+#include <errno.h>
+#include <grp.h>
+#include <poll.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+static int ECDSA_SIG_set0(ECDSA_SIG *sig, BIGNUM *r, BIGNUM *s)
+{
+    BN_clear_free(sig->r);
+    BN_clear_free(sig->s);
+    sig->r = r;
+    sig->s = s;
+    return 1;
+}
+#endif
+
+
+bool SciTokensRules::resolve_identity(std::string &err)
+{
+    if (m_username.empty()) {return true;}
+
+    long buflen = sysconf(_SC_GETPW_R_SIZE_MAX);
+    std::vector<char> buf(buflen > 0 ? buflen : 16384);
+    struct passwd pwd, *result = nullptr;
+    int retval;
+    while ((retval = getpwnam_r(m_username.c_str(), &pwd, &buf[0], buf.size(), &result)) == ERANGE) {
+        buf.resize(buf.size() * 2);
+    }
+    if (retval || !result) {
+        err = "Unable to resolve mapped user " + m_username +
+              (retval ? std::string(": ") + strerror(retval) : std::string(": no such user"));
+        return false;
+    }
+
+    std::vector<gid_t> gids(32);
+    int ngroups = gids.size();
+    while (getgrouplist(m_username.c_str(), pwd.pw_gid, &gids[0], &ngroups) < 0) {
+        gids.resize(ngroups > static_cast<int>(gids.size()) ? ngroups : gids.size() * 2);
+        ngroups = gids.size();
+    }
+    gids.resize(ngroups);
+
+    std::string gids_str;
+    for (const auto gid : gids) {
+        if (!gids_str.empty()) {gids_str += ",";}
+        gids_str += std::to_string(gid);
+    }
+    m_attributes.emplace_back("scitokens.uid", std::to_string(pwd.pw_uid));
+    m_attributes.emplace_back("scitokens.gid", std::to_string(pwd.pw_gid));
+    m_attributes.emplace_back("scitokens.gids", gids_str);
+    return true;
+}
+
+
+#ifdef SCITOKENS_SELFCHECK
+void SciTokensSelfCheck(const char *routine, const std::string &input, bool passed)
+{
+    if (passed) {return;}
+    std::string escaped;
+    for (unsigned char c : input) {
+        char buf[5];
+        if (c >= 0x20 && c < 0x7f && c != '\\') {
+            escaped.push_back(c);
+        } else {
+            snprintf(buf, sizeof(buf), "\\x%02x", c);
+            escaped += buf;
+        }
+    }
+    fprintf(stderr, "SciTokens self-check failed: %s disagrees with its reference implementation on \"%s\"\n",
+            routine, escaped.c_str());
+    abort();
+}
+#endif
+
+
+// Reference for NormalizePath(), on split components.
+std::string NormalizePathReference(const std::string &path)
+{
+    std::vector<std::string> components;
+    std::stringstream ss(path);
+    std::string component;
+    while (std::getline(ss, component, '/')) {
+        if (component.empty() || component == ".") {continue;}
+        if (component == "..") {
+            if (!components.empty()) {components.pop_back();}
+        } else {
+            components.push_back(component);
+        }
+    }
+    std::string result;
+    for (const auto &entry : components) {
+        result += "/" + entry;
+    }
+    return result.empty() ? "/" : result;
+}
+
+
+// Reference for PercentDecode(), with the C library's hex parsing.
+bool PercentDecodeReference(const std::string &input, std::string &output)
+{
+    output.clear();
+    for (size_t idx = 0; idx < input.size(); idx++) {
+        if (input[idx] != '%') {
+            output += input[idx];
+            continue;
+        }
+        if (input.size() - idx < 3 || !isxdigit(static_cast<unsigned char>(input[idx + 1])) ||
+            !isxdigit(static_cast<unsigned char>(input[idx + 2]))) {
+            return false;
+        }
+        output += static_cast<char>(strtol(input.substr(idx + 1, 2).c_str(), nullptr, 16));
+        idx += 2;
+    }
+    return true;
+}
+
+
+// Reference for Base64UrlDecode(): decodes each group of four characters
+// with a lookup in the alphabet.
+bool Base64UrlDecodeReference(std::string input, std::string &output)
+{
+    static const std::string alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    while (!input.empty() && input.back() == '=') {input.pop_back();}
+    if (input.size() % 4 == 1) {return false;}
+    output.clear();
+    for (size_t idx = 0; idx < input.size(); idx += 4) {
+        std::string group = input.substr(idx, 4);
+        uint32_t bits = 0;
+        for (size_t pos = 0; pos < 4; pos++) {
+            size_t value = (pos < group.size()) ? alphabet.find(group[pos]) : 0;
+            if (value == std::string::npos) {return false;}
+            bits = (bits << 6) | value;
+        }
+        for (size_t byte = 0; byte + 1 < group.size(); byte++) {
+            output += static_cast<char>((bits >> (16 - 8 * byte)) & 0xff);
+        }
+    }
+    return true;
+}
+
+
+std::string NormalizePath(const std::string &path)
+{
+    std::vector<std::string> components;
+    const char *remaining = path.c_str();
+    const char *component;
+    size_t len;
+    while ((component = SciTokensPathTrie::next_component(remaining, len))) {
+        if (len == 2 && component[0] == '.' && component[1] == '.') {
+            if (!components.empty()) {components.pop_back();}
+        } else {
+            components.emplace_back(component, len);
+        }
+    }
+    std::string result;
+    for (const auto &entry : components) {
+        result += "/";
+        result += entry;
+    }
+    if (result.empty()) {result = "/";}
+#ifdef SCITOKENS_SELFCHECK
+    SciTokensSelfCheck("NormalizePath", path, result == NormalizePathReference(path));
+#endif
+    return result;
+}
+
+
+// Join a token's absolute path onto the issuer's base path.  The token path
+// is normalized on its own first, so its ".." components stop at its root and
+// never climb out of `base_path`.
+static std::string JoinBasePath(const std::string &base_path, const std::string &path)
+{
+    return NormalizePath(base_path + NormalizePath(path));
+}
+
+
+// Parse a WLCG-style scope string (e.g., "storage.read:/data storage.modify:/data/user")
+// into ACLs relative to `base_path`.  Scopes not concerning storage are ignored;
+// returns false if a storage scope is malformed.
+static bool ParseScope(const std::string &scope, const std::string &base_path,
+                       std::vector<std::pair<SciTokensOp, std::string>> &acls)
+{
+    static const struct {
+        const char *m_scope;
+        std::vector<SciTokensOp> m_aops;
+    } scope_aops[] = {
+        {"storage.read", {SciTokensOp_Read}},
+        {"storage.create", {SciTokensOp_Create, SciTokensOp_Mkdir}},
+        {"storage.modify", {SciTokensOp_Create, SciTokensOp_Mkdir, SciTokensOp_Update, SciTokensOp_Delete, SciTokensOp_Rename}},
+    };
+    std::istringstream scope_stream(scope);
+    std::string entry;
+    while (scope_stream >> entry) {
+        auto pos = entry.find(':');
+        std::string authz = entry.substr(0, pos);
+        std::string path = (pos == std::string::npos || pos + 1 == entry.size()) ? "/" : entry.substr(pos + 1);
+        for (const auto &mapping : scope_aops) {
+            if (authz != mapping.m_scope) {continue;}
+            if (path[0] != '/') {return false;}
+            path = JoinBasePath(base_path, path);
+            for (const auto aop : mapping.m_aops) {
+                acls.emplace_back(aop, path);
+            }
+        }
+    }
+    return true;
+}
+
+
+// ParseScope() with a process-wide cache of the parsed ACLs by base path and
+// scope string: the tokens of a workflow share their scopes, so each set is
+// only split and normalized once.
+static bool ParseScopeCached(const std::string &scope, const std::string &base_path,
+                             std::vector<std::pair<SciTokensOp, std::string>> &acls)
+{
+    typedef std::vector<std::pair<SciTokensOp, std::string>> Acls;
+    static const size_t max_cached = 1024;
+    static std::mutex mutex;
+    // A null entry records a malformed scope.
+    static std::unordered_map<std::string, std::shared_ptr<const Acls>> cache;
+
+    std::string key(base_path);
+    key.push_back('\0');
+    key += scope;
+    std::shared_ptr<const Acls> parsed;
+    bool cached = false;
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        auto iter = cache.find(key);
+        if (iter != cache.end()) {
+            parsed = iter->second;
+            cached = true;
+        }
+    }
+    if (!cached) {
+        std::shared_ptr<Acls> fresh(new Acls());
+        if (ParseScope(scope, base_path, *fresh)) {parsed = fresh;}
+        std::lock_guard<std::mutex> guard(mutex);
+        if (cache.size() >= max_cached) {
+            cache.clear();
+        }
+        cache.emplace(key, parsed);
+    }
+    if (!parsed) {return false;}
+    acls.insert(acls.end(), parsed->begin(), parsed->end());
+    return true;
+}
+
+
+bool PercentDecode(const char *input, size_t len, std::string &output)
+{
+    static const auto hex = [](char c) -> int {
+        if (c >= '0' && c <= '9') {return c - '0';}
+        if (c >= 'a' && c <= 'f') {return c - 'a' + 10;}
+        if (c >= 'A' && c <= 'F') {return c - 'A' + 10;}
+        return -1;
+    };
+    output.clear();
+    output.reserve(len);
+    bool valid = true;
+    for (size_t idx = 0; idx < len; idx++) {
+        if (input[idx] != '%') {
+            output.push_back(input[idx]);
+            continue;
+        }
+        int high, low;
+        if (idx + 2 >= len || (high = hex(input[idx + 1])) < 0 || (low = hex(input[idx + 2])) < 0) {
+            valid = false;
+            break;
+        }
+        output.push_back(static_cast<char>((high << 4) | low));
+        idx += 2;
+    }
+#ifdef SCITOKENS_SELFCHECK
+    std::string reference;
+    SciTokensSelfCheck("PercentDecode", std::string(input, len),
+                       PercentDecodeReference(std::string(input, len), reference) == valid &&
+                       (!valid || reference == output));
+#endif
+    return valid;
+}
+
+
+bool Base64UrlDecode(const char *input, size_t len, std::string &output)
+{
+    static const auto value = [](char c) -> int {
+        if (c >= 'A' && c <= 'Z') {return c - 'A';}
+        if (c >= 'a' && c <= 'z') {return c - 'a' + 26;}
+        if (c >= '0' && c <= '9') {return c - '0' + 52;}
+        if (c == '-') {return 62;}
+        if (c == '_') {return 63;}
+        return -1;
+    };
+#ifdef SCITOKENS_SELFCHECK
+    const std::string original(input, len);
+#endif
+    while (len && input[len - 1] == '=') {len--;}
+    bool valid = (len % 4 != 1);
+    output.clear();
+    output.reserve(len * 3 / 4);
+    unsigned accumulator = 0;
+    int bits = 0;
+    for (size_t idx = 0; valid && idx < len; idx++) {
+        int val = value(input[idx]);
+        if (val < 0) {
+            valid = false;
+            break;
+        }
+        accumulator = (accumulator << 6) | val;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            output.push_back(static_cast<char>((accumulator >> bits) & 0xff));
+        }
+    }
+#ifdef SCITOKENS_SELFCHECK
+    std::string reference;
+    SciTokensSelfCheck("Base64UrlDecode", original,
+                       Base64UrlDecodeReference(original, reference) == valid && (!valid || reference == output));
+#endif
+    return valid;
+}
+
+
+void SciTokensPKeyDeleter::operator()(EVP_PKEY *key) const
+{
+    EVP_PKEY_free(key);
+}
+
+
+// The verify contexts of the calling thread, by key.  Each context holds a
+// reference to its key, so a key cannot be freed, and its address reused,
+// while the thread caches a context for it.
+class SciTokensVerifyContexts
+{
+public:
+    ~SciTokensVerifyContexts() {
+        for (auto &entry : m_contexts) {EVP_PKEY_CTX_free(entry.second);}
+        EVP_MD_CTX_free(m_digest);
+        EVP_MD_CTX_free(m_message);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        EVP_MD_free(m_sha256);
+#endif
+    }
+
+    // The thread's context verifying SHA-256 signatures of `key`.
+    EVP_PKEY_CTX *get(EVP_PKEY *key) {
+        auto iter = m_contexts.find(key);
+        if (iter != m_contexts.end()) {return iter->second;}
+        EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(key, nullptr);
+        if (ctx && (EVP_PKEY_verify_init(ctx) != 1 || EVP_PKEY_CTX_set_signature_md(ctx, EVP_sha256()) != 1)) {
+            EVP_PKEY_CTX_free(ctx);
+            ctx = nullptr;
+        }
+        if (ctx) {m_contexts[key] = ctx;}
+        return ctx;
+    }
+
+    // The thread's context verifying signatures of `key` over whole messages
+    // (EdDSA, which hashes internally).  Initialized on every use, as OpenSSL
+    // does not promise that a one-shot verification leaves it reusable.
+    EVP_MD_CTX *get_message(EVP_PKEY *key) {
+        if (!m_message && !(m_message = EVP_MD_CTX_new())) {return nullptr;}
+        return (EVP_DigestVerifyInit(m_message, nullptr, nullptr, nullptr, key) == 1) ? m_message : nullptr;
+    }
+
+    // Compute the SHA-256 digest of `data` into `md` with the thread's digest context.
+    bool digest(const char *data, size_t len, unsigned char *md, unsigned &md_len) {
+        if (!m_digest && !(m_digest = EVP_MD_CTX_new())) {return false;}
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        // Fetch the implementation once rather than on every initialization.
+        if (!m_sha256 && !(m_sha256 = EVP_MD_fetch(nullptr, "SHA256", nullptr))) {return false;}
+        const EVP_MD *sha256 = m_sha256;
+#else
+        const EVP_MD *sha256 = EVP_sha256();
+#endif
+        return EVP_DigestInit_ex(m_digest, sha256, nullptr) == 1 && EVP_DigestUpdate(m_digest, data, len) == 1 &&
+               EVP_DigestFinal_ex(m_digest, md, &md_len) == 1;
+    }
+
+private:
+    std::unordered_map<EVP_PKEY *, EVP_PKEY_CTX *> m_contexts;
+    EVP_MD_CTX *m_digest{nullptr};
+    EVP_MD_CTX *m_message{nullptr};
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_MD *m_sha256{nullptr};
+#endif
+};
+
+static thread_local SciTokensVerifyContexts g_verify_contexts;
+
+
+std::unique_ptr<SciTokensVerifyKey> SciTokensVerifyKey::Load(const std::string &fname, std::string &err)
+{
+    std::unique_ptr<SciTokensVerifyKey> result;
+    BIO *bio = BIO_new_file(fname.c_str(), "r");
+    if (!bio) {
+        err = "Unable to open public key file " + fname;
+        return result;
+    }
+    SciTokensPKey key(PEM_read_bio_PUBKEY(bio, nullptr, nullptr, nullptr));
+    BIO_free(bio);
+    if (!key) {
+        err = "Unable to parse PEM-encoded public key in " + fname;
+        return result;
+    }
+    int type = EVP_PKEY_base_id(key.get());
+    bool supported = (type == EVP_PKEY_RSA || type == EVP_PKEY_EC);
+#ifdef EVP_PKEY_ED25519
+    supported = supported || (type == EVP_PKEY_ED25519);
+#endif
+    if (!supported) {
+        err = "Unsupported public key type in " + fname;
+        return result;
+    }
+    result.reset(new SciTokensVerifyKey(std::move(key), type));
+
+    // Verify a dummy signature so the key's lazily computed arithmetic state
+    // (the Montgomery context of an RSA modulus, the EC group's tables) is
+    // built now rather than by the first token.
+    static const unsigned char ec_signature[] = {0x30, 0x06, 0x02, 0x01, 0x01, 0x02, 0x01, 0x01};
+    std::vector<unsigned char> signature(EVP_PKEY_size(result->m_key.get()), 0);
+    if (type == EVP_PKEY_EC) {
+        result->verify("", 0, ec_signature, sizeof(ec_signature));
+    } else {
+        result->verify("", 0, &signature[0], signature.size());
+    }
+    return result;
+}
+
+
+bool SciTokensVerifyKey::verify(const char *data, size_t len, const unsigned char *signature, size_t siglen) const
+{
+    bool valid;
+#ifdef EVP_PKEY_ED25519
+    if (m_type == EVP_PKEY_ED25519) {
+        EVP_MD_CTX *ctx = g_verify_contexts.get_message(m_key.get());
+        valid = ctx && EVP_DigestVerify(ctx, signature, siglen, reinterpret_cast<const unsigned char *>(data), len) == 1;
+        ERR_clear_error();
+        return valid;
+    }
+#endif
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned md_len;
+    EVP_PKEY_CTX *ctx = g_verify_contexts.get(m_key.get());
+    valid = ctx && g_verify_contexts.digest(data, len, md, md_len) &&
+        EVP_PKEY_verify(ctx, signature, siglen, md, md_len) == 1;
+    ERR_clear_error();
+    return valid;
+}
+
+bool SciTokensIssuerTable::load(const std::string &fname, SciTokensLog &log)
+{
+    log.Say("Trying to load configuration from ", fname.c_str());
+    std::vector<std::pair<std::string, std::map<std::string, std::string>>> sections;
+    errno = 0;
+    std::ifstream fp(fname);
+    if (!fp) {
+        if (errno == ENOENT) {return true;}
+        log.Emsg("Config", errno, "open configuration file", fname.c_str());
+        return false;
+    }
+    if (!parse_ini(fp, sections, log)) {return false;}
+
+    for (const auto &section : sections) {
+        std::string lower(section.first);
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        if (!lower.compare(0, 6, "group ")) {
+            load_group(section.first, section.second, log);
+        } else if (!lower.compare(0, 7, "issuer ")) {
+            load_issuer(section.first, section.second, log);
+        }
+    }
+    std::sort(m_issuers.begin(), m_issuers.end(),
+              [](const SciTokensIssuer &left, const SciTokensIssuer &right) {return left.m_issuer < right.m_issuer;});
+    return true;
+}
+
+
+bool SciTokensIssuerTable::get_bool(const std::string &value)
+{
+    std::string lower(value);
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    return lower == "1" || lower == "yes" || lower == "true" || lower == "on";
+}
+
+
+void SciTokensIssuerTable::load_issuer(const std::string &name, const std::map<std::string, std::string> &options,
+                                       SciTokensLog &log)
+{
+    auto issuer_iter = options.find("issuer");
+    auto base_path_iter = options.find("base_path");
+    if (issuer_iter == options.end()) {
+        log.Say("Ignoring section ", name.c_str(), " as it has no `issuer` option set.");
+        return;
+    }
+    if (base_path_iter == options.end()) {
+        log.Say("Ignoring section ", name.c_str(), " as it has no `base_path` option set.");
+        return;
+    }
+    SciTokensIssuer issuer;
+    issuer.m_name = name;
+    issuer.m_issuer = issuer_iter->second;
+    issuer.m_base_path = NormalizePath(base_path_iter->second);
+    auto iter = options.find("map_subject");
+    if (iter != options.end()) {issuer.m_map_subject = get_bool(iter->second);}
+    iter = options.find("map_groups");
+    if (iter != options.end()) {issuer.m_map_groups = get_bool(iter->second);}
+    iter = options.find("authoritative");
+    if (iter != options.end()) {issuer.m_authoritative = get_bool(iter->second);}
+    iter = options.find("deny");
+    if (iter != options.end()) {
+        std::vector<std::pair<SciTokensOp, std::string>> acls;
+        if (!ParseScope(iter->second, issuer.m_base_path, acls)) {
+            log.Say("Ignoring invalid `deny` option in section ", name.c_str());
+        } else {
+            for (const auto &acl : acls) {
+                if (SciTokensGlobMatcher::is_glob(acl.second)) {
+                    issuer.m_deny_globs.add(acl.second, acl.first);
+                } else {
+                    issuer.m_deny.insert(acl.second, acl.first, true);
+                }
+            }
+            issuer.m_deny_globs.compile();
+            issuer.m_has_deny = !acls.empty();
+        }
+    }
+    iter = options.find("public_key_file");
+    if (iter != options.end()) {
+        std::string err;
+        issuer.m_public_key = SciTokensVerifyKey::Load(iter->second, err);
+        if (!issuer.m_public_key) {
+            // The python engine fetches the issuer's keys itself, so the
+            // issuer is kept; the other engines reject its tokens.
+            issuer.m_key_error = err;
+            log.Emsg("Config", "Unable to load the public_key_file of", name.c_str(), err.c_str());
+        }
+    }
+    log.Say("Configured token access for ", name.c_str(), " (issuer ", issuer.m_issuer.c_str(),
+            "): base path ", issuer.m_base_path.c_str());
+
+    // A later section for the same issuer replaces the earlier one.
+    for (auto &entry : m_issuers) {
+        if (entry.m_issuer == issuer.m_issuer) {
+            entry = std::move(issuer);
+            return;
+        }
+    }
+    m_issuers.emplace_back(std::move(issuer));
+}
+
+
+void SciTokensIssuerTable::load_group(const std::string &name, const std::map<std::string, std::string> &options,
+                                      SciTokensLog &log)
+{
+    for (const char *option : {"issuer", "group", "path", "authz"}) {
+        if (options.find(option) == options.end()) {
+            log.Say("Ignoring section ", name.c_str(), " as it has no `", option, "` option set.");
+            return;
+        }
+    }
+    std::vector<SciTokensOp> aops;
+    std::istringstream authz_stream(options.at("authz"));
+    std::string authz;
+    while (std::getline(authz_stream, authz, ',')) {
+        authz.erase(0, authz.find_first_not_of(" \t"));
+        authz.erase(authz.find_last_not_of(" \t") + 1);
+        if (authz == "read") {
+            aops.push_back(SciTokensOp_Read);
+        } else if (authz == "write") {
+            aops.push_back(SciTokensOp_Update);
+            aops.push_back(SciTokensOp_Create);
+        } else {
+            log.Say("Ignoring section ", name.c_str(), " as it has an invalid `authz` option.");
+            return;
+        }
+    }
+    std::string path = NormalizePath(options.at("path"));
+    SciTokensPathTrie &trie = m_groups[SciTokensRules::group_key(options.at("issuer"), options.at("group"))];
+    for (const auto aop : aops) {
+        trie.insert(path, aop);
+    }
+    log.Say("Configured group access for ", name.c_str(), " (group ", options.at("group").c_str(), "): ",
+            path.c_str());
+}
+
+
+// A parser for the subset of the python ConfigParser INI syntax used by
+// scitokens.cfg: sections, `key = value` or `key: value` options (with
+// lower-cased keys), indented continuation lines, and comments.
+bool SciTokensIssuerTable::parse_ini(std::istream &input,
+                                     std::vector<std::pair<std::string, std::map<std::string, std::string>>> &sections,
+                                     SciTokensLog &log)
+{
+    std::string line, last_key;
+    int lineno = 0;
+    while (std::getline(input, line)) {
+        lineno++;
+        if (!line.empty() && line.back() == '\r') {line.pop_back();}
+        size_t start = line.find_first_not_of(" \t");
+        if (start == std::string::npos || line[start] == '#' || line[start] == ';') {continue;}
+        if (start > 0 && !last_key.empty()) {
+            sections.back().second[last_key] += "\n" + line.substr(start);
+            continue;
+        }
+        if (line[0] == '[') {
+            size_t end = line.find(']');
+            if (end == std::string::npos) {
+                log.Emsg("Config", "Invalid section header on line", std::to_string(lineno).c_str());
+                return false;
+            }
+            sections.emplace_back(line.substr(1, end - 1), std::map<std::string, std::string>());
+            last_key.clear();
+            continue;
+        }
+        size_t sep = line.find_first_of("=:");
+        if (sections.empty() || sep == std::string::npos) {
+            log.Emsg("Config", "Unable to parse configuration line", std::to_string(lineno).c_str());
+            return false;
+        }
+        std::string key = line.substr(0, sep), value = line.substr(sep + 1);
+        key.erase(key.find_last_not_of(" \t") + 1);
+        std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+        value.erase(0, value.find_first_not_of(" \t"));
+        value.erase(value.find_last_not_of(" \t") + 1);
+        sections.back().second[key] = value;
+        last_key = key;
+    }
+    return true;
+}
+
+
+// Verify the JWS signature over `signing_input` (RS256, ES256, or EdDSA).
+static bool VerifySignature(const SciTokensVerifyKey &key, const std::string &alg, const std::string &signing_input,
+                            const std::string &signature, std::string &err)
+{
+    int key_type = key.type();
+    std::string der_signature;
+    const std::string *sig = &signature;
+    if (alg == "RS256") {
+        if (key_type != EVP_PKEY_RSA) {
+            err = "RS256 token signature does not match the issuer's key type";
+            return false;
+        }
+    } else if (alg == "ES256") {
+        if (key_type != EVP_PKEY_EC) {
+            err = "ES256 token signature does not match the issuer's key type";
+            return false;
+        }
+        // JWS carries the raw r || s values; OpenSSL expects a DER-encoded ECDSA-Sig-Value.
+        if (signature.size() != 64) {
+            err = "Invalid ES256 signature length";
+            return false;
+        }
+        const unsigned char *raw = reinterpret_cast<const unsigned char *>(signature.data());
+        ECDSA_SIG *ec_sig = ECDSA_SIG_new();
+        BIGNUM *r = BN_bin2bn(raw, 32, nullptr);
+        BIGNUM *s = BN_bin2bn(raw + 32, 32, nullptr);
+        if (!ec_sig || !r || !s || !ECDSA_SIG_set0(ec_sig, r, s)) {
+            BN_free(r);
+            BN_free(s);
+            ECDSA_SIG_free(ec_sig);
+            err = "Unable to decode ES256 signature";
+            return false;
+        }
+        unsigned char *der = nullptr;
+        int der_len = i2d_ECDSA_SIG(ec_sig, &der);
+        ECDSA_SIG_free(ec_sig);
+        if (der_len <= 0) {
+            err = "Unable to encode ES256 signature";
+            return false;
+        }
+        der_signature.assign(reinterpret_cast<char *>(der), der_len);
+        OPENSSL_free(der);
+        sig = &der_signature;
+#ifdef EVP_PKEY_ED25519
+    } else if (alg == "EdDSA") {
+        // RFC 8037; only the Ed25519 curve is supported.
+        if (key_type != EVP_PKEY_ED25519) {
+            err = "EdDSA token signature does not match the issuer's key type";
+            return false;
+        }
+        if (signature.size() != 64) {
+            err = "Invalid EdDSA signature length";
+            return false;
+        }
+#endif
+    } else {
+        err = "Unsupported token signature algorithm " + alg;
+        return false;
+    }
+
+    bool valid = key.verify(signing_input.data(), signing_input.size(),
+                            reinterpret_cast<const unsigned char *>(sig->data()), sig->size());
+    if (!valid) {err = "Token signature verification failed";}
+    return valid;
+}
+
+
+// Collect a claim holding either a string or a list of strings.
+static bool ClaimStrings(const SciTokensJson &value, std::vector<std::string> &strings)
+{
+    if (value.m_type == SciTokensJson::String) {
+        strings.push_back(value.m_string);
+        return true;
+    }
+    if (value.m_type != SciTokensJson::Array) {return false;}
+    for (const auto &entry : value.m_array) {
+        if (entry.m_type != SciTokensJson::String) {return false;}
+        strings.push_back(entry.m_string);
+    }
+    return true;
+}
+
+
+// Validate a token for SciTokensNativeValidator.  Returns false (with `err`
+// set) if the token is invalid; `err` may also describe why a valid token
+// grants nothing.  The signature is only skipped by the stub engine.
+static bool GenerateNativeAcls(const char *authz, const SciTokensIssuerTable &issuers, SciTokensInfo &info,
+                               std::string &err, bool verify=true)
+{
+    static const char bearer[] = "Bearer ";
+    static const size_t bearer_len = sizeof(bearer) - 1;
+    static const uint64_t clock_skew = 60;
+
+    std::string header;
+    size_t authz_len = strlen(authz);
+    // Most headers are not percent-encoded; skip the decoding when possible.
+    if (memchr(authz, '%', authz_len)) {
+        if (!PercentDecode(authz, authz_len, header)) {
+            err = "Invalid percent-encoding in authorization";
+            return false;
+        }
+    } else {
+        header.assign(authz, authz_len);
+    }
+    if (header.compare(0, bearer_len, bearer)) {return true;}
+
+    size_t first_dot = header.find('.', bearer_len);
+    size_t second_dot = (first_dot == std::string::npos) ? first_dot : header.find('.', first_dot + 1);
+    if (second_dot == std::string::npos || header.find('.', second_dot + 1) != std::string::npos) {
+        err = "Token is not a serialized JWS";
+        return false;
+    }
+    std::string jose_str, claims_str, signature;
+    SciTokensJson jose, claims;
+    if (!Base64UrlDecode(header.data() + bearer_len, first_dot - bearer_len, jose_str) ||
+        !Base64UrlDecode(header.data() + first_dot + 1, second_dot - first_dot - 1, claims_str) ||
+        !Base64UrlDecode(header.data() + second_dot + 1, header.size() - second_dot - 1, signature) ||
+        !SciTokensJson::parse(jose_str, jose) || !SciTokensJson::parse(claims_str, claims) ||
+        claims.m_type != SciTokensJson::Object) {
+        err = "Unable to decode token";
+        return false;
+    }
+
+    const SciTokensJson *iss = claims.get("iss");
+    if (!iss || iss->m_type != SciTokensJson::String) {
+        err = "Token has no issuer";
+        return false;
+    }
+    const SciTokensIssuer *issuer = issuers.find(iss->m_string);
+    if (!issuer) {
+        err = "Token issuer (" + iss->m_string + ") not configured.";
+        return true;
+    }
+    if (!issuer->m_key_error.empty()) {
+        err = "Unable to load the public_key_file of token issuer " + iss->m_string + ": " + issuer->m_key_error;
+        return false;
+    }
+    if (verify && !issuer->m_public_key) {
+        err = "No public_key_file configured for token issuer " + iss->m_string;
+        return false;
+    }
+    const SciTokensJson *alg = jose.get("alg");
+    if (!alg || alg->m_type != SciTokensJson::String ||
+        (verify && !VerifySignature(*issuer->m_public_key, alg->m_string,
+                                    header.substr(bearer_len, second_dot - bearer_len), signature, err))) {
+        if (err.empty()) {err = "Token has no signature algorithm";}
+        return false;
+    }
+
+    double now = time(nullptr);
+    const SciTokensJson *exp = claims.get("exp");
+    if (!exp || exp->m_type != SciTokensJson::Number || exp->m_number - now <= 0) {
+        err = "Token is expired or has no valid `exp` claim";
+        return false;
+    }
+    info.m_expiry = static_cast<uint64_t>(exp->m_number - now);
+    const SciTokensJson *iat = claims.get("iat");
+    if (iat && (iat->m_type != SciTokensJson::Number || !(now + clock_skew > iat->m_number))) {
+        err = "Token `iat` claim is invalid";
+        return false;
+    }
+    const SciTokensJson *nbf = claims.get("nbf");
+    if (nbf && (nbf->m_type != SciTokensJson::Number || !(now + clock_skew >= nbf->m_number))) {
+        err = "Token is not yet valid";
+        return false;
+    }
+
+    std::vector<SciTokensOp> aops;
+    std::vector<std::string> values;
+    const SciTokensJson *claim = claims.get("authz");
+    if (claim) {
+        if (!ClaimStrings(*claim, values)) {
+            err = "Invalid `authz` claim";
+            return false;
+        }
+        for (const auto &value : values) {
+            if (value == "read") {
+                aops.push_back(SciTokensOp_Read);
+            } else if (value == "write") {
+                aops.push_back(SciTokensOp_Update);
+                aops.push_back(SciTokensOp_Create);
+            } else {
+                err = "Invalid `authz` claim: " + value;
+                return false;
+            }
+        }
+    }
+    std::vector<std::string> paths;
+    claim = claims.get("path");
+    if (claim && !ClaimStrings(*claim, paths)) {
+        err = "Invalid `path` claim";
+        return false;
+    }
+    for (const auto &path : paths) {
+        if (path.empty() || path[0] != '/') {
+            err = "Invalid `path` claim: " + path;
+            return false;
+        }
+    }
+    if (!aops.empty() && paths.empty()) {
+        err = "If a filesystem authorization is provided, a path must also be set";
+        return false;
+    }
+    for (const auto aop : aops) {
+        for (const auto &path : paths) {
+            info.m_acls.emplace_back(aop, JoinBasePath(issuer->m_base_path, path));
+        }
+    }
+    claim = claims.get("scope");
+    if (claim && (claim->m_type != SciTokensJson::String || !ParseScopeCached(claim->m_string, issuer->m_base_path, info.m_acls))) {
+        err = "Invalid `scope` claim";
+        return false;
+    }
+
+    claim = claims.get("sub");
+    if (claim && claim->m_type == SciTokensJson::String) {
+        info.m_subject = claim->m_string;
+    }
+    claim = claims.get("wlcg.groups");
+    if (claim && !ClaimStrings(*claim, info.m_groups)) {
+        err = "Invalid `wlcg.groups` claim";
+        return false;
+    }
+    info.m_issuer = issuer->m_issuer;
+    if (issuer->m_map_subject) {
+        info.m_username = info.m_subject;
+    }
+    return true;
+}
+
+
+void SciTokensValidatorStats::report(const char *engine, uint64_t elapsed, SciTokensLog &log)
+{
+    uint64_t count = m_count.exchange(0, std::memory_order_relaxed);
+    uint64_t rejected = m_rejected.exchange(0, std::memory_order_relaxed);
+    uint64_t total_ns = m_total_ns.exchange(0, std::memory_order_relaxed);
+    uint64_t max_ns = m_max_ns.exchange(0, std::memory_order_relaxed);
+    uint64_t buckets[m_nbuckets];
+    for (unsigned idx = 0; idx < m_nbuckets; idx++) {
+        buckets[idx] = m_buckets[idx].exchange(0, std::memory_order_relaxed);
+    }
+    if (!count) {return;}
+
+    // Percentiles are reported as the upper bound of their bucket.
+    uint64_t p50 = 0, p99 = 0, seen = 0;
+    for (unsigned idx = 0; idx < m_nbuckets; idx++) {
+        seen += buckets[idx];
+        if (!p50 && 2 * seen >= count) {p50 = uint64_t(1) << idx;}
+        if (!p99 && 100 * seen >= 99 * count) {p99 = uint64_t(1) << idx;}
+    }
+    std::stringstream ss;
+    ss << "Validation engine " << engine << ": " << count << " tokens (" << rejected << " rejected) in "
+       << elapsed << "s; latency mean " << total_ns / count / 1000 << "us, p50 <" << p50 << "us, p99 <" << p99
+       << "us, max " << max_ns / 1000 << "us";
+    log.Say(ss.str().c_str());
+}
+
+
+std::unique_ptr<SciTokensValidator> SciTokensValidator::Make(const std::string &engine,
+                                                             const std::string &worker_program,
+                                                             const std::string &config_file, unsigned workers)
+{
+    std::unique_ptr<SciTokensValidator> validator;
+    if (engine == "native") {
+        validator.reset(new SciTokensNativeValidator());
+    } else if (engine == "worker") {
+        validator.reset(new SciTokensWorkerValidator(worker_program, config_file, workers));
+    } else if (engine == "stub") {
+        validator.reset(new SciTokensStubValidator());
+    }
+    return validator;
+}
+
+
+bool SciTokensNativeValidator::Init(const SciTokensIssuerTable &issuers, SciTokensLog &log)
+{
+    m_issuers = &issuers;
+    m_log = &log;
+    for (const auto &issuer : issuers.issuers()) {
+        if (!issuer.m_key_error.empty()) {
+            log.Say("Tokens from ", issuer.m_name.c_str(), " will be rejected as its `public_key_file` could not be "
+                    "loaded.");
+        } else if (!issuer.m_public_key) {
+            log.Say("Tokens from ", issuer.m_name.c_str(),
+                    " will be rejected as it has no `public_key_file` option set.");
+        }
+    }
+    return true;
+}
+
+
+bool SciTokensNativeValidator::Validate(const char *authz, SciTokensInfo &info)
+{
+    std::string err;
+    if (!GenerateNativeAcls(authz, *m_issuers, info, err)) {
+        m_log->Emsg("Access", "Error generating ACLs for authorization:", err.c_str());
+        return false;
+    }
+    if (!err.empty()) {
+        m_log->Say(err.c_str());
+    }
+    return true;
+}
+
+
+bool SciTokensStubValidator::Init(const SciTokensIssuerTable &issuers, SciTokensLog &log)
+{
+    m_issuers = &issuers;
+    m_log = &log;
+    log.Say("WARNING: the stub validation engine does not verify token signatures; use it for testing only.");
+    return true;
+}
+
+
+bool SciTokensStubValidator::Validate(const char *authz, SciTokensInfo &info)
+{
+    std::string err;
+    if (!GenerateNativeAcls(authz, *m_issuers, info, err, false)) {
+        m_log->Emsg("Access", "Error generating ACLs for authorization:", err.c_str());
+        return false;
+    }
+    if (!err.empty()) {
+        m_log->Say(err.c_str());
+    }
+    return true;
+}
+
+
+SciTokensWorkerValidator::~SciTokensWorkerValidator()
+{
+    for (auto &worker : m_pool) {
+        Stop(worker);
+    }
+}
+
+
+bool SciTokensWorkerValidator::Init(const SciTokensIssuerTable &, SciTokensLog &log)
+{
+    m_log = &log;
+    m_pool.resize(m_workers);
+    for (size_t idx = 0; idx < m_pool.size(); idx++) {
+        if (!Spawn(m_pool[idx])) {return false;}
+        m_idle.push_back(idx);
+    }
+    log.Say("Started ", std::to_string(m_workers).c_str(), " token validation workers (", m_program.c_str(), ")");
+    return true;
+}
+
+
+bool SciTokensWorkerValidator::Validate(const char *authz, SciTokensInfo &info)
+{
+    // Tokens never hold NUL bytes; anything longer than a frame cannot be one.
+    size_t authz_len = strlen(authz);
+    if (authz_len > m_max_frame) {
+        m_log->Emsg("Access", "Authorization is too long to be a token");
+        return false;
+    }
+
+    size_t idx;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this]() {return !m_idle.empty();});
+        idx = m_idle.back();
+        m_idle.pop_back();
+    }
+    Worker &worker = m_pool[idx];
+    std::string reply;
+    bool success = (worker.m_fd >= 0 || Spawn(worker)) && WriteFrame(worker.m_fd, std::string(authz, authz_len)) &&
+                   ReadFrame(worker.m_fd, reply, m_timeout_ms);
+    if (!success) {
+        m_log->Emsg("Access", "Token validation worker failed; restarting it");
+        Stop(worker);
+        Spawn(worker);
+    }
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_idle.push_back(idx);
+    }
+    m_cond.notify_one();
+
+    if (!success || reply.empty()) {return false;}
+    if (!DecodeInfo(reply, info)) {
+        m_log->Emsg("Access", "Invalid reply from token validation worker");
+        return false;
+    }
+    return true;
+}
+
+
+bool SciTokensWorkerValidator::Spawn(Worker &worker)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+        m_log->Emsg("Config", errno, "create token validation worker socket");
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        m_log->Emsg("Config", errno, "start token validation worker");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        // The worker talks over its standard input and output; stderr is
+        // shared with the server log.
+        if (dup2(fds[1], 0) == -1 || dup2(fds[1], 1) == -1) {_exit(127);}
+        execl(m_program.c_str(), m_program.c_str(), m_config_file.c_str(), static_cast<char *>(nullptr));
+        _exit(127);
+    }
+    close(fds[1]);
+    worker.m_pid = pid;
+    worker.m_fd = fds[0];
+
+    std::string ready;
+    if (!ReadFrame(worker.m_fd, ready, m_timeout_ms) || ready != "ready") {
+        m_log->Emsg("Config", "Token validation worker", m_program.c_str(), "failed to start");
+        Stop(worker);
+        return false;
+    }
+    return true;
+}
+
+
+void SciTokensWorkerValidator::Stop(Worker &worker)
+{
+    if (worker.m_fd >= 0) {
+        close(worker.m_fd);
+        worker.m_fd = -1;
+    }
+    if (worker.m_pid > 0) {
+        kill(worker.m_pid, SIGKILL);
+        while (waitpid(worker.m_pid, nullptr, 0) == -1 && errno == EINTR) {}
+        worker.m_pid = -1;
+    }
+}
+
+
+// Frames are a 32-bit length, in host byte order, followed by the payload.
+bool SciTokensWorkerValidator::ReadFrame(int fd, std::string &frame, int timeout_ms)
+{
+    uint32_t len = 0;
+    std::string header;
+    for (std::string *buffer : {&header, &frame}) {
+        size_t want = (buffer == &header) ? sizeof(len) : len;
+        buffer->resize(want);
+        size_t have = 0;
+        while (have < want) {
+            struct pollfd pfd = {fd, POLLIN, 0};
+            int rc = poll(&pfd, 1, timeout_ms);
+            if (rc == -1 && errno == EINTR) {continue;}
+            if (rc <= 0) {return false;}
+            ssize_t count = read(fd, &(*buffer)[have], want - have);
+            if (count == -1 && errno == EINTR) {continue;}
+            if (count <= 0) {return false;}
+            have += count;
+        }
+        if (buffer == &header) {
+            memcpy(&len, header.data(), sizeof(len));
+            if (len > m_max_frame) {return false;}
+        }
+    }
+    return true;
+}
+
+
+bool SciTokensWorkerValidator::WriteFrame(int fd, const std::string &frame)
+{
+    uint32_t len = frame.size();
+    std::string data(reinterpret_cast<const char *>(&len), sizeof(len));
+    data += frame;
+    size_t sent = 0;
+    while (sent < data.size()) {
+        // MSG_NOSIGNAL: a dead peer yields EPIPE rather than SIGPIPE.
+        ssize_t count = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (count == -1 && errno == EINTR) {continue;}
+        if (count <= 0) {return false;}
+        sent += count;
+    }
+    return true;
+}
+
+
+// SciTokensInfo is encoded as a sequence of length-prefixed strings.
+std::string SciTokensWorkerValidator::EncodeInfo(const SciTokensInfo &info)
+{
+    std::string data;
+    auto put = [&data](const std::string &value) {
+        uint32_t len = value.size();
+        data.append(reinterpret_cast<const char *>(&len), sizeof(len));
+        data += value;
+    };
+    put(std::to_string(info.m_expiry));
+    put(info.m_username);
+    put(info.m_issuer);
+    put(info.m_subject);
+    put(std::to_string(info.m_groups.size()));
+    for (const auto &group : info.m_groups) {
+        put(group);
+    }
+    put(std::to_string(info.m_acls.size()));
+    for (const auto &acl : info.m_acls) {
+        put(std::to_string(static_cast<int>(acl.first)));
+        put(acl.second);
+    }
+    return data;
+}
+
+
+bool SciTokensWorkerValidator::DecodeInfo(const std::string &data, SciTokensInfo &info)
+{
+    size_t pos = 0;
+    auto get = [&data, &pos](std::string &value) {
+        uint32_t len;
+        if (data.size() - pos < sizeof(len)) {return false;}
+        memcpy(&len, data.data() + pos, sizeof(len));
+        pos += sizeof(len);
+        if (data.size() - pos < len) {return false;}
+        value.assign(data, pos, len);
+        pos += len;
+        return true;
+    };
+    auto get_number = [&get](uint64_t &value) {
+        std::string str;
+        if (!get(str) || str.empty()) {return false;}
+        char *end;
+        value = strtoull(str.c_str(), &end, 10);
+        return *end == '\0';
+    };
+    uint64_t count, op;
+    if (!get_number(info.m_expiry) || !get(info.m_username) || !get(info.m_issuer) || !get(info.m_subject) ||
+        !get_number(count) || count > data.size()) {
+        return false;
+    }
+    info.m_groups.resize(count);
+    for (auto &group : info.m_groups) {
+        if (!get(group)) {return false;}
+    }
+    if (!get_number(count) || count > data.size()) {return false;}
+    info.m_acls.resize(count);
+    for (auto &acl : info.m_acls) {
+        if (!get_number(op) || op > SciTokensOp_Last || !get(acl.second)) {return false;}
+        acl.first = static_cast<SciTokensOp>(op);
+    }
+    return pos == data.size();
+}
+
+
+int SciTokensWorkerValidator::Serve(int fd, const std::string &config_file, SciTokensLog &log)
+{
+    SciTokensIssuerTable issuers;
+    SciTokensNativeValidator validator;
+    if (!issuers.load(config_file, log) || !validator.Init(issuers, log) || !WriteFrame(fd, "ready")) {
+        return 1;
+    }
+    std::string authz;
+    while (ReadFrame(fd, authz, -1)) {
+        SciTokensInfo info;
+        // Tokens are ASCII; a NUL byte would truncate the value validated.
+        bool valid = authz.find('\0') == std::string::npos && validator.Validate(authz.c_str(), info);
+        if (!WriteFrame(fd, valid ? EncodeInfo(info) : std::string())) {return 1;}
+    }
+    return 0;
+}
+
+
+void SciTokensStderrLog::Say(const char *text1, const char *text2, const char *text3, const char *text4,
+                             const char *text5, const char *text6)
+{
+    std::string line;
+    for (const char *text : {text1, text2, text3, text4, text5, text6}) {
+        if (text) {line += text;}
+    }
+    line += '\n';
+    fputs(line.c_str(), stderr);
+}
+
+
+void SciTokensStderrLog::Emsg(const char *esfx, const char *text1, const char *text2, const char *text3)
+{
+    Say(esfx, ": ", text1, text2 ? " " : nullptr, text2, text3 ? (std::string(" ") + text3).c_str() : nullptr);
+}
+
+
+int SciTokensStderrLog::Emsg(const char *esfx, int ecode, const char *text1, const char *text2)
+{
+    Say(esfx, ": Unable to ", text1, text2 ? " " : nullptr, text2, (std::string("; ") + strerror(ecode)).c_str());
+    return ecode;
+}
+
+
+SciTokensShadow::SciTokensShadow(const SciTokensAuthorizer &core, std::unique_ptr<SciTokensValidator> validator,
+                                 double fraction, SciTokensLog &log) :
+    m_core(core),
+    m_validator(std::move(validator)),
+    m_fraction(std::min(std::max(fraction, 0.0), 1.0)),
+    m_log(log)
+{}
+
+
+SciTokensShadow::~SciTokensShadow()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_stop = true;
+    }
+    m_cond.notify_all();
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+
+bool SciTokensShadow::Init(const SciTokensIssuerTable &issuers)
+{
+    if (!m_validator->Init(issuers, m_log)) {
+        m_log.Emsg("Config", "Failed to initialize the", m_validator->Name(), "shadow validation engine");
+        return false;
+    }
+    m_thread = std::thread(&SciTokensShadow::Run, this);
+    std::stringstream ss;
+    ss << "Comparing the validation engine with the " << m_validator->Name() << " engine on " << m_fraction * 100
+       << "% of the validated tokens";
+    m_log.Say(ss.str().c_str());
+    return true;
+}
+
+
+void SciTokensShadow::Submit(const char *authz, const std::shared_ptr<SciTokensRules> &primary)
+{
+    // Sample the tokens where the running sum of the fraction crosses an integer.
+    uint64_t idx = m_submitted.fetch_add(1, std::memory_order_relaxed);
+    if (static_cast<uint64_t>((idx + 1) * m_fraction) == static_cast<uint64_t>(idx * m_fraction)) {return;}
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        if (m_queue.size() >= m_max_queue) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        m_queue.push_back(Task{authz, primary});
+    }
+    m_cond.notify_all();
+}
+
+
+void SciTokensShadow::Report(uint64_t elapsed)
+{
+    uint64_t compared = m_compared.exchange(0, std::memory_order_relaxed);
+    uint64_t mismatched = m_mismatched.exchange(0, std::memory_order_relaxed);
+    uint64_t dropped = m_dropped.exchange(0, std::memory_order_relaxed);
+    m_logged.store(0, std::memory_order_relaxed);
+    m_validator->Stats().report((std::string("shadow ") + m_validator->Name()).c_str(), elapsed, m_log);
+    if (!compared && !dropped) {return;}
+    std::stringstream ss;
+    ss << "Shadow engine " << m_validator->Name() << ": " << compared << " tokens compared, " << mismatched
+       << " mismatched, " << dropped << " dropped (queue full) in " << elapsed << "s";
+    m_log.Say(ss.str().c_str());
+}
+
+
+void SciTokensShadow::Run()
+{
+    while (true) {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [this]() {return m_stop || !m_queue.empty();});
+            if (m_stop) {return;}
+            task = std::move(m_queue.front());
+            m_queue.pop_front();
+            m_comparing = true;
+        }
+        Compare(task);
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            m_comparing = false;
+        }
+        m_cond.notify_all();
+    }
+}
+
+
+void SciTokensShadow::Drain()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cond.wait(lock, [this]() {return m_stop || (m_queue.empty() && !m_comparing);});
+}
+
+
+void SciTokensShadow::Compare(const Task &task)
+{
+    SciTokensInfo info;
+    bool valid = m_validator->TimedValidate(task.m_authz.c_str(), info);
+    std::shared_ptr<SciTokensRules> shadow;
+    if (valid) {
+        shadow = m_core.Compile(info);
+    }
+    m_compared.fetch_add(1, std::memory_order_relaxed);
+
+    const SciTokensRules *primary = task.m_primary.get();
+    std::string diff;
+    if (!primary != !shadow) {
+        diff = primary ? "rejects a token the primary engine accepts" : "accepts a token the primary engine rejects";
+    } else if (primary) {
+        uint64_t primary_expiry = primary->get_expiry_time(), shadow_expiry = shadow->get_expiry_time();
+        const char *primary_user = primary->get_username(), *shadow_user = shadow->get_username();
+        if (std::max(primary_expiry, shadow_expiry) - std::min(primary_expiry, shadow_expiry) > m_expiry_tolerance) {
+            diff = "expires the token " + std::to_string(static_cast<int64_t>(shadow_expiry - primary_expiry)) +
+                   "s after the primary engine";
+        } else if ((primary_user ? primary_user : "") != std::string(shadow_user ? shadow_user : "")) {
+            diff = "maps the token to user '" + std::string(shadow_user ? shadow_user : "") + "' instead of '" +
+                   (primary_user ? primary_user : "") + "'";
+        } else if (primary->get_issuer() != shadow->get_issuer() || primary->get_groups() != shadow->get_groups()) {
+            diff = "extracts different issuer or group claims";
+        } else if (!primary->equivalent(*shadow)) {
+            diff = "compiles rules granting different privileges";
+        }
+    }
+    if (diff.empty()) {return;}
+    m_mismatched.fetch_add(1, std::memory_order_relaxed);
+    if (m_logged.fetch_add(1, std::memory_order_relaxed) >= m_max_logged) {return;}
+    // The token itself is a credential; only its issuer is logged.
+    const std::string &issuer = primary ? primary->get_issuer() : (shadow ? shadow->get_issuer() : info.m_issuer);
+    std::string msg = std::string("Engine ") + m_validator->Name() + " " + diff + "; token issuer: " +
+                      (issuer.empty() ? "unknown" : issuer);
+    m_log.Emsg("Shadow", msg.c_str());
+}
+
+
+SciTokensValidationPool::SciTokensValidationPool(SciTokensValidator &validator, unsigned threads,
+                                                 unsigned deadline_ms) :
+    m_validator(validator),
+    m_deadline(deadline_ms)
+{
+    for (unsigned idx = 0; idx < threads; idx++) {
+        m_queues.emplace_back(new Queue());
+    }
+    for (unsigned idx = 0; idx < threads; idx++) {
+        m_threads.emplace_back(&SciTokensValidationPool::Run, this, idx);
+    }
+}
+
+
+SciTokensValidationPool::~SciTokensValidationPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_stop = true;
+    }
+    m_cond.notify_all();
+    for (auto &thread : m_threads) {
+        thread.join();
+    }
+}
+
+
+bool SciTokensValidationPool::Validate(const char *authz, SciTokensInfo &info,
+                                       std::chrono::steady_clock::time_point deadline, bool &expired)
+{
+    expired = false;
+    std::shared_ptr<Task> task(new Task());
+    task->m_authz = authz;
+    {
+        // Counted before it is queued, so the count never underestimates the
+        // queued tasks, and under the pool mutex, so a parking thread sees it.
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_pending.fetch_add(1, std::memory_order_relaxed);
+    }
+    Queue &queue = *m_queues[m_next.fetch_add(1, std::memory_order_relaxed) % m_queues.size()];
+    {
+        std::lock_guard<std::mutex> guard(queue.m_mutex);
+        queue.m_tasks.push_back(task);
+    }
+    m_cond.notify_one();
+
+    std::unique_lock<std::mutex> lock(task->m_mutex);
+    auto done = [&task]() {return task->m_state.load(std::memory_order_acquire) == Task::Done;};
+    if (!task->m_cond.wait_until(lock, deadline, done)) {
+        // Still queued at the deadline: take it back unvalidated.
+        int expected = Task::Queued;
+        if (task->m_state.compare_exchange_strong(expected, Task::Running)) {
+            m_expired.fetch_add(1, std::memory_order_relaxed);
+            expired = true;
+            return false;
+        }
+        task->m_cond.wait(lock, done);
+    }
+    info = std::move(task->m_info);
+    return task->m_valid;
+}
+
+
+std::shared_ptr<SciTokensValidationPool::Task> SciTokensValidationPool::Take(size_t idx)
+{
+    std::shared_ptr<Task> task;
+    for (size_t offset = 0; offset < m_queues.size() && !task; offset++) {
+        Queue &queue = *m_queues[(idx + offset) % m_queues.size()];
+        std::lock_guard<std::mutex> guard(queue.m_mutex);
+        if (queue.m_tasks.empty()) {continue;}
+        // The owner serves its deque in order; thieves take the newest task.
+        if (offset) {
+            task = std::move(queue.m_tasks.back());
+            queue.m_tasks.pop_back();
+            m_stolen.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            task = std::move(queue.m_tasks.front());
+            queue.m_tasks.pop_front();
+        }
+    }
+    if (task) {m_pending.fetch_sub(1, std::memory_order_relaxed);}
+    return task;
+}
+
+
+void SciTokensValidationPool::Run(size_t idx)
+{
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [this]() {return m_stop || m_pending.load(std::memory_order_relaxed);});
+            if (m_stop) {return;}
+        }
+        std::shared_ptr<Task> task = Take(idx);
+        if (!task) {
+            // Another thread took it, or it is being queued.
+            std::this_thread::yield();
+            continue;
+        }
+        int expected = Task::Queued;
+        // Skip tasks whose submitter took them back at the deadline.
+        if (!task->m_state.compare_exchange_strong(expected, Task::Running)) {continue;}
+        task->m_valid = m_validator.TimedValidate(task->m_authz, task->m_info);
+        m_validated.fetch_add(1, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> guard(task->m_mutex);
+            task->m_state.store(Task::Done, std::memory_order_release);
+        }
+        task->m_cond.notify_one();
+    }
+}
+
+
+void SciTokensValidationPool::Report(uint64_t elapsed, SciTokensLog &log)
+{
+    uint64_t validated = m_validated.exchange(0, std::memory_order_relaxed);
+    uint64_t stolen = m_stolen.exchange(0, std::memory_order_relaxed);
+    uint64_t expired = m_expired.exchange(0, std::memory_order_relaxed);
+    if (!validated && !expired) {return;}
+    std::stringstream ss;
+    ss << "Validation pool: " << validated << " tokens validated by " << m_threads.size() << " threads (" << stolen
+       << " stolen), " << expired << " not validated by the " << m_deadline.count() << "ms deadline in "
+       << elapsed << "s";
+    log.Say(ss.str().c_str());
+}
+
+
+bool SciTokensFairQueue::Acquire(const std::string &issuer, std::chrono::steady_clock::time_point deadline)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_busy < m_slots && m_turns.empty()) {
+        m_busy++;
+        return true;
+    }
+    Waiter waiter;
+    auto &queue = m_queues[issuer];
+    if (queue.empty()) {m_turns.push_back(issuer);}
+    queue.push_back(&waiter);
+    // Release() hands its slot over; m_busy is unchanged.
+    if (waiter.m_cond.wait_until(lock, deadline, [&waiter]() {return waiter.m_admitted;})) {return true;}
+
+    // Not admitted by the deadline: leave the queue, and the issuer's turn
+    // with it if this was its last waiting token.
+    auto iter = m_queues.find(issuer);
+    iter->second.erase(std::find(iter->second.begin(), iter->second.end(), &waiter));
+    if (iter->second.empty()) {
+        m_queues.erase(iter);
+        m_turns.erase(std::find(m_turns.begin(), m_turns.end(), issuer));
+    }
+    m_expired.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+
+void SciTokensFairQueue::Release()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (m_turns.empty()) {
+        m_busy--;
+        return;
+    }
+    // Every token costs one turn, so each issuer's deficit is spent by a
+    // single admission: the issuer is admitted once and goes to the back.
+    std::string issuer = std::move(m_turns.front());
+    m_turns.pop_front();
+    auto iter = m_queues.find(issuer);
+    Waiter *waiter = iter->second.front();
+    iter->second.pop_front();
+    if (iter->second.empty()) {
+        m_queues.erase(iter);
+    } else {
+        m_turns.push_back(std::move(issuer));
+    }
+    waiter->m_admitted = true;
+    waiter->m_cond.notify_one();
+}
+
+
+void SciTokensFairQueue::Report(uint64_t elapsed, SciTokensLog &log)
+{
+    uint64_t expired = m_expired.exchange(0, std::memory_order_relaxed);
+    if (!expired) {return;}
+    std::stringstream ss;
+    ss << "Validation queue: " << expired << " tokens not validated after waiting " << m_deadline.count()
+       << "ms for a slot in " << elapsed << "s";
+    log.Say(ss.str().c_str());
+}
+
+
+bool SciTokensAuthorizer::Config(const std::string &config_file)
+{
+    if (!m_issuers.load(config_file, m_log)) {return false;}
+    for (const auto &issuer : m_issuers.issuers()) {
+        if (issuer.m_authoritative) {
+            m_authoritative.insert(issuer.m_base_path);
+            m_log.Say("Token issuer is authoritative for ", issuer.m_base_path.c_str());
+        }
+    }
+    if (!m_validator) {
+        m_validator.reset(new SciTokensNativeValidator());
+    }
+    if (!m_validator->Init(m_issuers, m_log)) {
+        m_log.Emsg("Config", "Failed to initialize the", m_validator->Name(), "validation engine");
+        return false;
+    }
+    if (m_pool_threads) {
+        m_pool.reset(new SciTokensValidationPool(*m_validator, m_pool_threads, m_pool_deadline_ms));
+        m_fair_queue.reset(new SciTokensFairQueue(m_pool_threads, m_pool_deadline_ms));
+        m_log.Say("Validating tokens in a pool of ", std::to_string(m_pool_threads).c_str(), " threads");
+    }
+    if (m_shadow_validator) {
+        m_shadow.reset(new SciTokensShadow(*this, std::move(m_shadow_validator), m_shadow_fraction, m_log));
+        if (!m_shadow->Init(m_issuers)) {return false;}
+    }
+    return true;
+}
+
+
+std::shared_ptr<SciTokensRules> SciTokensAuthorizer::Lookup(const void *session, const char *authz, bool &rebound)
+{
+    rebound = false;
+    size_t authz_len = strlen(authz);
+    uint64_t epoch = m_epoch.load(std::memory_order_acquire);
+    std::shared_ptr<SciTokensRules> rules = m_sessions.get(session, authz, authz_len, epoch);
+    if (rules) {return rules;}
+
+    Check(monotonic_time());
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        const auto iter = m_map.find(authz);
+        if (iter != m_map.end() && !iter->second->expired()) {
+            rules = iter->second;
+        }
+    }
+    if (!rules) {
+        SciTokensInfo info;
+        // The waits for a slot and for a pool thread share one deadline.  A
+        // token that gets neither by then is not validated at all, so that
+        // validation never runs outside the slots and pool: the request is
+        // decided as if it carried no token.  The issuer is only extracted
+        // when the token has to wait.
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_pool_deadline_ms);
+        if (m_fair_queue && !m_fair_queue->TryAcquire() && !m_fair_queue->Acquire(Flow(authz), deadline)) {
+            return rules;
+        }
+        bool expired = false;
+        bool valid = m_pool ? m_pool->Validate(authz, info, deadline, expired) : m_validator->TimedValidate(authz, info);
+        if (m_fair_queue) {m_fair_queue->Release();}
+        if (expired) {return rules;}
+        if (!valid) {
+            if (m_shadow) {m_shadow->Submit(authz, rules);}
+            return rules;
+        }
+        rules = Compile(info);
+        if (m_shadow) {m_shadow->Submit(authz, rules);}
+        std::string err;
+        if (m_resolve_identity && !rules->resolve_identity(err)) {
+            m_log.Emsg("Access", err.c_str());
+        }
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            m_map[authz] = rules;
+        }
+    }
+    m_sessions.put(session, authz, authz_len, epoch, rules);
+    rebound = true;
+    return rules;
+}
+
+
+std::string SciTokensAuthorizer::Flow(const char *authz) const
+{
+    static const char bearer[] = "Bearer ";
+    std::string header;
+    size_t authz_len = strlen(authz);
+    if (!memchr(authz, '%', authz_len)) {
+        header.assign(authz, authz_len);
+    } else if (!PercentDecode(authz, authz_len, header)) {
+        return "";
+    }
+    size_t first_dot = header.find('.');
+    size_t second_dot = (first_dot == std::string::npos) ? first_dot : header.find('.', first_dot + 1);
+    std::string claims_str;
+    SciTokensJson claims;
+    if (header.compare(0, sizeof(bearer) - 1, bearer) || second_dot == std::string::npos ||
+        !Base64UrlDecode(header.data() + first_dot + 1, second_dot - first_dot - 1, claims_str) ||
+        !SciTokensJson::parse(claims_str, claims)) {
+        return "";
+    }
+    const SciTokensJson *iss = claims.get("iss");
+    if (!iss || iss->m_type != SciTokensJson::String || !m_issuers.find(iss->m_string)) {return "";}
+    return iss->m_string;
+}
+
+
+std::shared_ptr<SciTokensRules> SciTokensAuthorizer::Compile(const SciTokensInfo &info) const
+{
+    std::shared_ptr<SciTokensRules> rules(new SciTokensRules(monotonic_time() + info.m_expiry, info.m_username));
+    rules->parse(info.m_acls);
+    rules->set_claims(info.m_issuer, info.m_subject, info.m_groups);
+    rules->merge_groups(m_issuers.groups());
+    const SciTokensIssuer *issuer_info = m_issuers.find(info.m_issuer);
+    rules->set_map_groups(issuer_info && issuer_info->m_map_groups);
+    if (issuer_info && issuer_info->m_has_deny) {
+        rules->merge(issuer_info->m_deny);
+        if (!issuer_info->m_deny_globs.empty()) {rules->set_deny_globs(issuer_info->m_deny_globs);}
+    }
+    rules->finalize();
+    return rules;
+}
+
+
+SciTokensPrivs SciTokensAuthorizer::Chain(SciTokensChain &chain, const char *path, SciTokensRules *rules) const
+{
+    if (m_authoritative.covers(path)) {return SciTokensPriv_None;}
+    if (!rules || !m_chain_cache_size) {return chain.Access();}
+    std::string key = chain.Key();
+    SciTokensPrivs privs;
+    if (!rules->get_chain_decision(key, privs)) {
+        privs = chain.Access();
+        rules->put_chain_decision(key, privs, m_chain_cache_size);
+    }
+    return privs;
+}
+
+
+void SciTokensAuthorizer::Check(uint64_t now)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (now <= m_next_clean) {return;}
+
+    bool evicted = false;
+    for (auto iter = m_map.begin(); iter != m_map.end(); ) {
+        if (iter->second->expired()) {
+            iter = m_map.erase(iter);
+            evicted = true;
+        } else {
+            ++iter;
+        }
+    }
+    m_next_clean = now + m_expiry_secs;
+    // Drop every per-connection binding so evicted rules are released.
+    if (evicted) {
+        m_epoch.fetch_add(1, std::memory_order_release);
+    }
+    m_validator->Stats().report(m_validator->Name(), now - m_last_report, m_log);
+    if (m_pool) {m_pool->Report(now - m_last_report, m_log);}
+    if (m_fair_queue) {m_fair_queue->Report(now - m_last_report, m_log);}
+    if (m_shadow) {m_shadow->Report(now - m_last_report);}
+    m_last_report = now;
+}
@@ -0,0 +1,1528 @@
+// The SciTokens authorization core: the issuer configuration, token
+// validation, rule compilation, path matching, and token cache behind the
+// XRootD plugin.  It has no dependency on XRootD and may be embedded by other
+// services checking SciTokens (e.g., HTTP gateways or proxies).
+//
+// Most users only need SciTokensAuthorizer: configure it from scitokens.cfg,
+// then Lookup() the compiled rules for the authorization presented with a
+// request and apply() them to the requested operation and path.
+
+#ifndef SCITOKENS_CORE_H
+#define SCITOKENS_CORE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <initializer_list>
+#include <iosfwd>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct evp_pkey_st EVP_PKEY;
+
+#ifdef SCITOKENS_SELFCHECK
+// Self-check builds (the SCITOKENS_SELFCHECK build option) compare the
+// optimized parsing and matching routines with slow reference
+// implementations on every call; on a disagreement, the routine and its
+// input are printed and the process aborts.  Not for production use.
+void SciTokensSelfCheck(const char *routine, const std::string &input, bool passed);
+#endif
+
+// Operations on a path; numbered as XRootD's Access_Operation.
+enum SciTokensOp {
+    SciTokensOp_Any = 0,
+    SciTokensOp_Chmod,
+    SciTokensOp_Chown,
+    SciTokensOp_Create,
+    SciTokensOp_Delete,
+    SciTokensOp_Insert,
+    SciTokensOp_Lock,
+    SciTokensOp_Mkdir,
+    SciTokensOp_Read,
+    SciTokensOp_Readdir,
+    SciTokensOp_Rename,
+    SciTokensOp_Stat,
+    SciTokensOp_Update,
+    SciTokensOp_Last = SciTokensOp_Update
+};
+
+// Privilege bits; valued as XRootD's XrdAccPrivs.
+enum SciTokensPrivs {
+    SciTokensPriv_All     = 0x07f,
+    SciTokensPriv_Delete  = 0x001,
+    SciTokensPriv_Insert  = 0x002,
+    SciTokensPriv_Lock    = 0x004,
+    SciTokensPriv_Lookup  = 0x008,
+    SciTokensPriv_Rename  = 0x010,
+    SciTokensPriv_Read    = 0x020,
+    SciTokensPriv_Write   = 0x040,
+    SciTokensPriv_Chmod   = 0x063,
+    SciTokensPriv_Chown   = 0x063,
+    SciTokensPriv_Create  = 0x062,
+    SciTokensPriv_Mkdir   = 0x002,
+    SciTokensPriv_Readdir = 0x020,
+    SciTokensPriv_Update  = 0x060,
+    SciTokensPriv_None    = 0x000
+};
+
+// Destination of the core's messages; the XRootD plugin forwards them to its
+// XrdSysError.  The signatures follow XrdSysError's.
+class SciTokensLog
+{
+public:
+    virtual ~SciTokensLog() {}
+
+    // Log the concatenation of the given pieces of text.
+    virtual void Say(const char *text1, const char *text2=0, const char *text3=0, const char *text4=0,
+                     const char *text5=0, const char *text6=0) = 0;
+
+    // Log an error message prefixed with `esfx`; with `ecode`, the message
+    // includes the description of that errno value.
+    virtual void Emsg(const char *esfx, const char *text1, const char *text2=0, const char *text3=0) = 0;
+    virtual int Emsg(const char *esfx, int ecode, const char *text1, const char *text2=0) = 0;
+};
+
+static inline uint64_t monotonic_time() {
+  struct timespec tp;
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &tp);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+#endif
+  return tp.tv_sec + (tp.tv_nsec >= 500000000);
+}
+
+
+// Privileges required by each SciTokensOp; the table must stay in 1-to-1
+// correspondence with the SciTokensOp enum.  It is shared by the rule
+// compiler (AddPriv) and by the XRootD plugin's Test().
+static constexpr SciTokensPrivs g_op_privs[SciTokensOp_Last + 1] = {
+    SciTokensPriv_None,     // SciTokensOp_Any
+    SciTokensPriv_Chmod,    // SciTokensOp_Chmod
+    SciTokensPriv_Chown,    // SciTokensOp_Chown
+    SciTokensPriv_Create,   // SciTokensOp_Create
+    SciTokensPriv_Delete,   // SciTokensOp_Delete
+    SciTokensPriv_Insert,   // SciTokensOp_Insert
+    SciTokensPriv_Lock,     // SciTokensOp_Lock
+    SciTokensPriv_Mkdir,    // SciTokensOp_Mkdir
+    SciTokensPriv_Read,     // SciTokensOp_Read
+    SciTokensPriv_Readdir,  // SciTokensOp_Readdir
+    SciTokensPriv_Rename,   // SciTokensOp_Rename
+    SciTokensPriv_Lookup,   // SciTokensOp_Stat
+    SciTokensPriv_Update    // SciTokensOp_Update
+};
+static_assert(sizeof(g_op_privs) / sizeof(g_op_privs[0]) == SciTokensOp_Update + 1,
+              "g_op_privs must have one entry per SciTokensOp");
+
+
+// Returns the privileges needed for `op`; out-of-range operations map to
+// SciTokensOp_Any (no privileges) without branching.
+static inline SciTokensPrivs OpPrivs(SciTokensOp op)
+{
+    unsigned idx = static_cast<unsigned>(op);
+    idx = (idx <= static_cast<unsigned>(SciTokensOp_Last)) ? idx : 0;
+    return g_op_privs[idx];
+}
+
+
+// Whether `privs` permit `op`: every privilege the operation requires must be
+// present.  Operations outside the SciTokensOp range are never permitted.
+static inline bool OpPermitted(int privs, int op)
+{
+    unsigned idx = static_cast<unsigned>(op);
+    int valid = idx <= static_cast<unsigned>(SciTokensOp_Last);
+    int need = OpPrivs(static_cast<SciTokensOp>(idx));
+    return valid & ((privs & need) == need);
+}
+
+
+static inline SciTokensPrivs AddPriv(SciTokensOp op, SciTokensPrivs privs)
+{
+    return static_cast<SciTokensPrivs>(static_cast<int>(privs) | static_cast<int>(OpPrivs(op)));
+}
+
+
+// Sets of operations are masks with bit `1 << op` set for each operation.
+static inline int OpBit(SciTokensOp op) {return 1 << op;}
+
+
+// The privileges for the operations of `granted` that are not `denied`.
+// XRootD's privileges overlap -- e.g., Update's include Read's -- so a granted
+// operation whose privileges would also permit a denied one is withheld too:
+// denying reads withholds updates, while denying updates leaves reads.
+static inline SciTokensPrivs OpsPrivs(int granted, int denied)
+{
+    int ops = granted & ~denied;
+    int privs = 0;
+    for (int op = SciTokensOp_Any; op <= SciTokensOp_Last; op++) {
+        if (ops & (1 << op)) {privs |= g_op_privs[op];}
+    }
+    for (int op = SciTokensOp_Any; denied && privs && op <= SciTokensOp_Last; op++) {
+        int need = g_op_privs[op];
+        if (!(denied & (1 << op)) || !need || (privs & need) != need) {continue;}
+        privs = 0;
+        for (int other = SciTokensOp_Any; other <= SciTokensOp_Last; other++) {
+            if (!(ops & (1 << other))) {continue;}
+            if (g_op_privs[other] & need) {
+                ops &= ~(1 << other);
+            } else {
+                privs |= g_op_privs[other];
+            }
+        }
+    }
+    return static_cast<SciTokensPrivs>(privs);
+}
+
+// A trie over the components of normalized paths.  Each node holds the
+// operations granted and denied on that path; rules apply to whole subtrees.
+//
+// Denies come from the configuration and grants from tokens and groups, so a
+// denied operation stays denied below that path whatever is granted deeper.
+// Precedence is resolved once, by finalize(): every node then carries the
+// operations granted and denied along its path and their effective
+// privileges (see OpsPrivs()), so a lookup just returns those of the deepest
+// node along the path.
+class SciTokensPathTrie
+{
+public:
+    SciTokensPathTrie() : m_root(new Node()) {}
+    SciTokensPathTrie(SciTokensPathTrie &&) = default;
+    SciTokensPathTrie &operator=(SciTokensPathTrie &&) = default;
+
+    void insert(const std::string &path, SciTokensOp op, bool deny=false) {
+        Node *node = m_root.get();
+        const char *component;
+        size_t len;
+        const char *remaining = path.c_str();
+        while ((component = next_component(remaining, len))) {
+            Node *child = node->find(component, len);
+            if (!child) {
+                node->m_children.emplace_back(std::string(component, len), std::unique_ptr<Node>(new Node()));
+                child = node->m_children.back().second.get();
+            }
+            node = child;
+        }
+        (deny ? node->m_deny : node->m_grant) |= OpBit(op);
+#ifdef SCITOKENS_SELFCHECK
+        m_entries.push_back(Entry{split(path.c_str()), op, deny});
+#endif
+    }
+
+    // Union the grants and denials of another trie into this one.
+    void merge(const SciTokensPathTrie &other) {
+        merge(*m_root, *other.m_root);
+#ifdef SCITOKENS_SELFCHECK
+        m_entries.insert(m_entries.end(), other.m_entries.begin(), other.m_entries.end());
+#endif
+    }
+
+    // Resolve precedence into each node's effective privileges; must be
+    // called after the last insert() or merge() and before lookup().
+    void finalize() {finalize(*m_root, 0, 0);}
+
+    // Returns the effective privileges of `path`; `granted` and `denied` are
+    // set to the operations granted and denied there.
+    SciTokensPrivs lookup(const char *path, int &granted, int &denied) const {
+        const Node *node = m_root.get();
+        const Node *deepest = node;
+        const char *component;
+        size_t len;
+        while ((component = next_component(path, len))) {
+            // Never grant through a path that is not canonical.
+            if (len == 2 && component[0] == '.' && component[1] == '.') {
+                granted = 0;
+                denied = ~0;
+                return SciTokensPriv_None;
+            }
+            if (node && (node = node->find(component, len))) {
+                deepest = node;
+            }
+        }
+        granted = deepest->m_granted;
+        denied = deepest->m_denied;
+        return static_cast<SciTokensPrivs>(deepest->m_effective);
+    }
+
+    // Whether both (finalized) tries yield the same privileges for every path.
+    bool equivalent(const SciTokensPathTrie &other) const {
+        return equivalent(m_root.get(), other.m_root.get(), 0, 0, 0, 0);
+    }
+
+#ifdef SCITOKENS_SELFCHECK
+    // Reference for lookup(): collects the operations of every inserted entry
+    // whose path is a prefix of `path`.
+    SciTokensPrivs lookup_reference(const char *path, int &granted, int &denied) const {
+        std::vector<std::string> components = split(path);
+        granted = 0;
+        denied = 0;
+        for (const auto &component : components) {
+            if (component == "..") {
+                denied = ~0;
+                return SciTokensPriv_None;
+            }
+        }
+        for (const auto &entry : m_entries) {
+            if (entry.m_components.size() > components.size() ||
+                !std::equal(entry.m_components.begin(), entry.m_components.end(), components.begin())) {
+                continue;
+            }
+            (entry.m_deny ? denied : granted) |= OpBit(entry.m_op);
+        }
+        return OpsPrivs(granted, denied);
+    }
+#endif
+
+    // Return the next non-empty, non-"." component of `path` and advance past it.
+    static const char *next_component(const char *&path, size_t &len) {
+        while (true) {
+            while (*path == '/') {path++;}
+            if (!*path) {return nullptr;}
+            const char *component = path;
+            while (*path && *path != '/') {path++;}
+            len = path - component;
+            if (len != 1 || component[0] != '.') {return component;}
+        }
+    }
+
+private:
+    struct Node
+    {
+        Node *find(const char *component, size_t len) const {
+            for (const auto &child : m_children) {
+                if (child.first.size() == len && !memcmp(child.first.data(), component, len)) {
+                    return child.second.get();
+                }
+            }
+            return nullptr;
+        }
+
+        // Operations granted and denied on this node's path itself.
+        int m_grant{0};
+        int m_deny{0};
+        // Operations granted and denied along the path, set by finalize().
+        int m_granted{0};
+        int m_denied{0};
+        int m_effective{0};
+        std::vector<std::pair<std::string, std::unique_ptr<Node>>> m_children;
+    };
+
+    static void merge(Node &into, const Node &from) {
+        into.m_grant |= from.m_grant;
+        into.m_deny |= from.m_deny;
+        for (const auto &child : from.m_children) {
+            Node *target = into.find(child.first.data(), child.first.size());
+            if (!target) {
+                into.m_children.emplace_back(child.first, std::unique_ptr<Node>(new Node()));
+                target = into.m_children.back().second.get();
+            }
+            merge(*target, *child.second);
+        }
+    }
+
+    // A missing node inherits the operations of its parent.
+    static bool equivalent(const Node *left, const Node *right, int left_allowed, int left_denied,
+                           int right_allowed, int right_denied) {
+        if (left) {
+            left_allowed = left->m_granted & ~left->m_denied;
+            left_denied = left->m_denied;
+        }
+        if (right) {
+            right_allowed = right->m_granted & ~right->m_denied;
+            right_denied = right->m_denied;
+        }
+        if (left_allowed != right_allowed || left_denied != right_denied) {return false;}
+        if (left) {
+            for (const auto &child : left->m_children) {
+                const Node *match = right ? right->find(child.first.data(), child.first.size()) : nullptr;
+                if (!equivalent(child.second.get(), match, left_allowed, left_denied, right_allowed, right_denied)) {
+                    return false;
+                }
+            }
+        }
+        if (right) {
+            for (const auto &child : right->m_children) {
+                if (left && left->find(child.first.data(), child.first.size())) {continue;}
+                if (!equivalent(nullptr, child.second.get(), left_allowed, left_denied, right_allowed,
+                                right_denied)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    static void finalize(Node &node, int parent_granted, int parent_denied) {
+        node.m_granted = parent_granted | node.m_grant;
+        node.m_denied = parent_denied | node.m_deny;
+        node.m_effective = OpsPrivs(node.m_granted, node.m_denied);
+        for (auto &child : node.m_children) {
+            finalize(*child.second, node.m_granted, node.m_denied);
+        }
+    }
+
+#ifdef SCITOKENS_SELFCHECK
+    struct Entry
+    {
+        std::vector<std::string> m_components;
+        SciTokensOp m_op;
+        bool m_deny;
+    };
+
+    static std::vector<std::string> split(const char *path) {
+        std::vector<std::string> components;
+        std::string component;
+        for (const char *ptr = path; ; ptr++) {
+            if (*ptr && *ptr != '/') {
+                component.push_back(*ptr);
+                continue;
+            }
+            if (!component.empty() && component != ".") {components.push_back(component);}
+            component.clear();
+            if (!*ptr) {return components;}
+        }
+    }
+
+    std::vector<Entry> m_entries;
+#endif
+    std::unique_ptr<Node> m_root;
+};
+
+// A set of path prefixes compiled into a component trie; testing whether a
+// path lies under any of them costs a single walk of the path.
+class SciTokensPrefixIndex
+{
+public:
+    bool empty() const {return m_root.m_children.empty() && !m_root.m_terminal;}
+
+    void insert(const std::string &prefix) {
+        Node *node = &m_root;
+        const char *component;
+        size_t len;
+        const char *remaining = prefix.c_str();
+        while ((component = SciTokensPathTrie::next_component(remaining, len))) {
+            Node *child = node->find(component, len);
+            if (!child) {
+                node->m_children.emplace_back(std::string(component, len), std::unique_ptr<Node>(new Node()));
+                child = node->m_children.back().second.get();
+            }
+            node = child;
+        }
+        node->m_terminal = true;
+    }
+
+    bool covers(const char *path) const {
+        const Node *node = &m_root;
+        const char *component;
+        size_t len;
+        while (!node->m_terminal) {
+            if (!(component = SciTokensPathTrie::next_component(path, len)) ||
+                !(node = node->find(component, len))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    struct Node
+    {
+        Node *find(const char *component, size_t len) const {
+            for (const auto &child : m_children) {
+                if (child.first.size() == len && !memcmp(child.first.data(), component, len)) {
+                    return child.second.get();
+                }
+            }
+            return nullptr;
+        }
+
+        bool m_terminal{false};
+        std::vector<std::pair<std::string, std::unique_ptr<Node>>> m_children;
+    };
+
+    Node m_root;
+};
+
+// Matches paths against glob patterns, where '*' matches any run of characters
+// and '?' any single character within one path component.  As with the path
+// trie, a pattern grants the paths it matches along with their subtrees.
+//
+// The patterns are compiled, when the token is validated, into a minimized DFA
+// over byte classes; matching is one table lookup per path byte, regardless of
+// the number of patterns.  Pathological pattern sets whose DFA would exceed
+// m_max_states fall back to matching each pattern in turn.
+class SciTokensGlobMatcher
+{
+public:
+    static bool is_glob(const std::string &path) {
+        return path.find_first_of("*?") != std::string::npos;
+    }
+
+    bool empty() const {return m_patterns.empty();}
+
+    void add(const std::string &pattern, SciTokensOp op) {
+        for (auto &entry : m_patterns) {
+            if (entry.first == pattern) {
+                entry.second |= OpBit(op);
+                return;
+            }
+        }
+        m_patterns.emplace_back(pattern, OpBit(op));
+    }
+
+    // Build the minimized DFA; must be called after the last add().  Tokens
+    // of a workflow share their glob scopes, so DFAs are cached by pattern
+    // set: building one costs far more than validating a token.
+    void compile() {
+        m_dfa.reset();
+        if (m_patterns.empty()) {return;}
+        std::sort(m_patterns.begin(), m_patterns.end());
+        std::string key;
+        for (const auto &entry : m_patterns) {
+            key += entry.first;
+            key.push_back('\0');
+            key += std::to_string(entry.second);
+            key.push_back('\0');
+        }
+
+        static std::mutex mutex;
+        static std::unordered_map<std::string, std::shared_ptr<const Dfa>> cache;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            auto iter = cache.find(key);
+            if (iter != cache.end()) {
+                m_dfa = iter->second;
+                return;
+            }
+        }
+        std::shared_ptr<Dfa> dfa(new Dfa());
+        if (!build(*dfa)) {return;}
+        m_dfa = dfa;
+        std::lock_guard<std::mutex> guard(mutex);
+        if (cache.size() >= m_max_cached) {
+            cache.clear();
+        }
+        cache.emplace(key, dfa);
+    }
+
+    // Returns the operations the patterns matching `path` grant.
+    int match(const char *path) const {
+        if (!m_dfa) {
+            return m_patterns.empty() ? 0 : match_naive(path);
+        }
+        const Dfa &dfa = *m_dfa;
+        unsigned state = dfa.m_start;
+        char prev = '\0';
+        for (const char *ptr = path; *ptr && state != dfa.m_dead; ptr++) {
+            // Repeated slashes are equivalent to a single one.
+            if (*ptr == '/' && prev == '/') {continue;}
+            prev = *ptr;
+            state = dfa.m_table[state * dfa.m_nclasses + dfa.m_class[static_cast<unsigned char>(*ptr)]];
+        }
+        return has_dotdot(path) ? 0 : dfa.m_accept[state];
+    }
+
+    // Whether both matchers hold the same patterns with the same privileges.
+    bool same_patterns(const SciTokensGlobMatcher &other) const {
+        auto left = m_patterns, right = other.m_patterns;
+        std::sort(left.begin(), left.end());
+        std::sort(right.begin(), right.end());
+        return left == right;
+    }
+
+    // Reference matcher: tries each pattern in turn.
+    int match_naive(const char *path) const {
+        if (has_dotdot(path)) {return 0;}
+        std::string normalized;
+        for (const char *ptr = path; *ptr; ptr++) {
+            if (*ptr == '/' && !normalized.empty() && normalized.back() == '/') {continue;}
+            normalized.push_back(*ptr);
+        }
+        int ops = 0;
+        for (const auto &entry : m_patterns) {
+            if (glob_prefix(entry.first.c_str(), normalized.c_str())) {ops |= entry.second;}
+        }
+        return ops;
+    }
+
+private:
+    // A minimized DFA over byte classes, shared by the matchers of all
+    // tokens with the same patterns.
+    struct Dfa
+    {
+        unsigned char m_class[256];
+        unsigned m_nclasses{0};
+        std::vector<unsigned> m_table;
+        std::vector<int> m_accept;
+        unsigned m_start{0};
+        unsigned m_dead{0};
+    };
+
+    // Build the DFA of the patterns; false if it has too many states, in
+    // which case the naive matcher is used.
+    bool build(Dfa &dfa) const {
+        // Partition the bytes into classes that no pattern distinguishes.
+        memset(dfa.m_class, 0, sizeof(dfa.m_class));
+        dfa.m_nclasses = 1;
+        dfa.m_class[static_cast<unsigned char>('/')] = dfa.m_nclasses++;
+        std::vector<unsigned char> representative{0, '/'};
+        for (const auto &entry : m_patterns) {
+            for (const char c : entry.first) {
+                unsigned char b = c;
+                if (c == '*' || c == '?' || dfa.m_class[b]) {continue;}
+                dfa.m_class[b] = dfa.m_nclasses++;
+                representative.push_back(b);
+            }
+        }
+        // Class 0 ("other") needs a byte appearing in no pattern to stand for it.
+        for (unsigned b = 1; b < 256; b++) {
+            if (!dfa.m_class[b] && b != '*' && b != '?') {representative[0] = b; break;}
+        }
+
+        // NFA state numbering: pattern i owns positions base[i]..base[i]+len
+        // plus a trailing "subtree" state reached on a '/' after a full match.
+        std::vector<unsigned> base;
+        unsigned nfa_states = 0;
+        for (const auto &entry : m_patterns) {
+            base.push_back(nfa_states);
+            nfa_states += entry.first.size() + 2;
+        }
+
+        std::map<std::vector<unsigned>, unsigned> dfa_ids;
+        std::vector<std::vector<unsigned>> dfa_sets;
+        std::vector<unsigned> table;
+        std::vector<int> accept;
+        auto intern_set = [&](std::vector<unsigned> &set) -> unsigned {
+            std::sort(set.begin(), set.end());
+            set.erase(std::unique(set.begin(), set.end()), set.end());
+            auto iter = dfa_ids.find(set);
+            if (iter != dfa_ids.end()) {return iter->second;}
+            unsigned id = dfa_sets.size();
+            dfa_ids.emplace(set, id);
+            dfa_sets.push_back(set);
+            int mask = 0;
+            for (unsigned state : set) {
+                size_t idx = pattern_of(base, state);
+                unsigned pos = state - base[idx];
+                if (pos >= m_patterns[idx].first.size()) {mask |= m_patterns[idx].second;}
+            }
+            accept.push_back(mask);
+            return id;
+        };
+
+        // State 0 is the dead state; state 1 the start state.
+        std::vector<unsigned> dead;
+        intern_set(dead);
+        std::vector<unsigned> start;
+        for (size_t idx = 0; idx < m_patterns.size(); idx++) {
+            closure(m_patterns[idx].first, base[idx], 0, start);
+        }
+        intern_set(start);
+
+        for (unsigned id = 0; id < dfa_sets.size(); id++) {
+            if (dfa_sets.size() > m_max_states) {
+                return false;
+            }
+            for (unsigned cls = 0; cls < dfa.m_nclasses; cls++) {
+                unsigned char b = representative[cls];
+                std::vector<unsigned> next;
+                for (unsigned state : dfa_sets[id]) {
+                    size_t idx = pattern_of(base, state);
+                    const std::string &pattern = m_patterns[idx].first;
+                    unsigned pos = state - base[idx];
+                    if (pos > pattern.size()) {
+                        next.push_back(state);
+                    } else if (pos == pattern.size()) {
+                        if (b == '/') {next.push_back(state + 1);}
+                    } else if (pattern[pos] == '*') {
+                        if (b != '/') {closure(pattern, base[idx], pos, next);}
+                    } else if (pattern[pos] == '?') {
+                        if (b != '/') {closure(pattern, base[idx], pos + 1, next);}
+                    } else if (static_cast<unsigned char>(pattern[pos]) == b) {
+                        closure(pattern, base[idx], pos + 1, next);
+                    }
+                }
+                table.push_back(intern_set(next));
+            }
+        }
+
+        minimize(table, accept, dfa);
+        return true;
+    }
+
+    static size_t pattern_of(const std::vector<unsigned> &base, unsigned state) {
+        return std::upper_bound(base.begin(), base.end(), state) - base.begin() - 1;
+    }
+
+    // Add the NFA state for `pos` in `pattern`, following the empty match of
+    // any '*' at that position.
+    static void closure(const std::string &pattern, unsigned base, unsigned pos, std::vector<unsigned> &set) {
+        set.push_back(base + pos);
+        while (pos < pattern.size() && pattern[pos] == '*') {
+            set.push_back(base + ++pos);
+        }
+    }
+
+    // Moore's algorithm: refine the partition by accept mask until no block
+    // can be split by its transitions, then rebuild the table over blocks.
+    static void minimize(const std::vector<unsigned> &table, const std::vector<int> &accept, Dfa &dfa) {
+        const unsigned nclasses = dfa.m_nclasses;
+        unsigned nstates = accept.size();
+        std::vector<unsigned> block(nstates);
+        {
+            std::map<int, unsigned> by_mask;
+            for (unsigned state = 0; state < nstates; state++) {
+                block[state] = by_mask.emplace(accept[state], by_mask.size()).first->second;
+            }
+        }
+        unsigned nblocks = 0;
+        while (true) {
+            std::map<std::vector<unsigned>, unsigned> signatures;
+            std::vector<unsigned> next_block(nstates);
+            for (unsigned state = 0; state < nstates; state++) {
+                std::vector<unsigned> signature{block[state]};
+                for (unsigned cls = 0; cls < nclasses; cls++) {
+                    signature.push_back(block[table[state * nclasses + cls]]);
+                }
+                next_block[state] = signatures.emplace(signature, signatures.size()).first->second;
+            }
+            block.swap(next_block);
+            if (signatures.size() == nblocks) {break;}
+            nblocks = signatures.size();
+        }
+
+        dfa.m_table.assign(nblocks * nclasses, 0);
+        dfa.m_accept.assign(nblocks, 0);
+        for (unsigned state = 0; state < nstates; state++) {
+            dfa.m_accept[block[state]] = accept[state];
+            for (unsigned cls = 0; cls < nclasses; cls++) {
+                dfa.m_table[block[state] * nclasses + cls] = block[table[state * nclasses + cls]];
+            }
+        }
+        dfa.m_dead = block[0];
+        dfa.m_start = block[1];
+    }
+
+    static bool has_dotdot(const char *path) {
+        for (const char *ptr = path; (ptr = strstr(ptr, "..")); ptr += 2) {
+            if ((ptr == path || ptr[-1] == '/') && (ptr[2] == '\0' || ptr[2] == '/')) {return true;}
+        }
+        return false;
+    }
+
+    // Whether `pattern` matches `path` or one of its ancestors.
+    static bool glob_prefix(const char *pattern, const char *path) {
+        while (*pattern) {
+            if (*pattern == '*') {
+                for (const char *ptr = path; ; ptr++) {
+                    if (glob_prefix(pattern + 1, ptr)) {return true;}
+                    if (!*ptr || *ptr == '/') {return false;}
+                }
+            }
+            if (!*path || *path == '/' ? *pattern != *path : (*pattern != '?' && *pattern != *path)) {
+                return false;
+            }
+            pattern++;
+            path++;
+        }
+        return !*path || *path == '/';
+    }
+
+    static constexpr unsigned m_max_states = 4096;
+    static constexpr size_t m_max_cached = 1024;
+
+    // Each pattern with the operations it grants.
+    std::vector<std::pair<std::string, int>> m_patterns;
+    std::shared_ptr<const Dfa> m_dfa;
+};
+
+// The outcome of validating a token: the ACLs it grants, how long (in
+// seconds) they may be cached, and the claims exported to other plugins.
+struct SciTokensInfo
+{
+    uint64_t m_expiry{60};
+    std::vector<std::pair<SciTokensOp, std::string>> m_acls;
+    std::string m_username;
+    std::string m_issuer;
+    std::string m_subject;
+    std::vector<std::string> m_groups;
+};
+
+class SciTokensRules
+{
+public:
+    SciTokensRules(uint64_t expiry_time, const std::string &username) :
+        m_expiry_time(expiry_time),
+        m_username(username)
+    {}
+
+    ~SciTokensRules() {}
+
+    SciTokensPrivs apply(SciTokensOp, const char *path) const {
+        int granted, denied;
+        SciTokensPrivs privs = m_trie.lookup(path, granted, denied);
+#ifdef SCITOKENS_SELFCHECK
+        int reference_granted, reference_denied;
+        SciTokensSelfCheck("SciTokensPathTrie::lookup", path,
+                           m_trie.lookup_reference(path, reference_granted, reference_denied) == privs &&
+                           reference_granted == granted && reference_denied == denied);
+        SciTokensSelfCheck("SciTokensGlobMatcher::match", path, m_globs.match(path) == m_globs.match_naive(path) &&
+                           m_deny_globs.match(path) == m_deny_globs.match_naive(path));
+#endif
+        if (m_globs.empty() && m_deny_globs.empty()) {return privs;}
+        return OpsPrivs(granted | m_globs.match(path), denied | m_deny_globs.match(path));
+    }
+
+    bool expired() const {return monotonic_time() > m_expiry_time;}
+
+    uint64_t get_expiry_time() const {return m_expiry_time;}
+
+    // Whether both rules grant the same privileges on every path; the
+    // identity claims are not compared.
+    bool equivalent(const SciTokensRules &other) const {
+        return m_trie.equivalent(other.m_trie) && m_globs.same_patterns(other.m_globs) &&
+               m_deny_globs.same_patterns(other.m_deny_globs);
+    }
+
+    void parse(const std::vector<std::pair<SciTokensOp, std::string>> &acls) {
+        for (const auto &acl : acls) {
+            if (SciTokensGlobMatcher::is_glob(acl.second)) {
+                m_globs.add(acl.second, acl.first);
+            } else {
+                m_trie.insert(acl.second, acl.first);
+            }
+        }
+    }
+
+    // Merge additional rules, such as the issuer's deny rules, into the token's.
+    void merge(const SciTokensPathTrie &rules) {m_trie.merge(rules);}
+
+    // Deny the operations of the issuer's (compiled) glob deny patterns on
+    // the paths they match; they take precedence over every grant.
+    void set_deny_globs(const SciTokensGlobMatcher &globs) {m_deny_globs = globs;}
+
+    // Precompute the effective privileges once all rules are known.
+    void finalize() {
+        m_trie.finalize();
+        m_globs.compile();
+    }
+
+    // The mapped username; nullptr if the token maps to no user.
+    const char *get_username() const {return m_username.empty() ? nullptr : m_username.c_str();}
+
+    // Resolve the mapped username to a Unix uid, gid, and supplementary groups.
+    // This is done once, when the token is validated; the result is kept as
+    // pre-built entity attributes so no NSS lookups happen on cache hits.
+    bool resolve_identity(std::string &err);
+
+    // Record the token's identity claims, pre-building the entity attribute
+    // strings so a cache hit attaches them without re-parsing the token.
+    void set_claims(const std::string &issuer, const std::string &subject, const std::vector<std::string> &groups) {
+        m_issuer = issuer;
+        m_groups = groups;
+        std::string groups_str;
+        for (const auto &group : groups) {
+            if (!groups_str.empty()) {groups_str += " ";}
+            groups_str += group;
+        }
+        if (!groups_str.empty()) {
+            m_groups_str = groups_str;
+            m_attributes.emplace_back("scitokens.groups", groups_str);
+        }
+        if (!issuer.empty()) {m_attributes.emplace_back("scitokens.iss", issuer);}
+        if (!subject.empty()) {m_attributes.emplace_back("scitokens.sub", subject);}
+    }
+
+    // Merge the grants configured for the token's groups; done once, when the
+    // token is validated, so requests never evaluate group membership.
+    void merge_groups(const std::unordered_map<std::string, SciTokensPathTrie> &group_index) {
+        for (const auto &group : m_groups) {
+            const auto iter = group_index.find(group_key(m_issuer, group));
+            if (iter != group_index.end()) {
+                m_trie.merge(iter->second);
+            }
+        }
+    }
+
+    static std::string group_key(const std::string &issuer, const std::string &group) {
+        std::string key(issuer);
+        key.push_back('\0');
+        key += group;
+        return key;
+    }
+
+    const std::string &get_issuer() const {return m_issuer;}
+    const std::vector<std::string> &get_groups() const {return m_groups;}
+    // Space-separated list of the token's groups for the entity's group
+    // list; nullptr if none, or if the issuer does not set `map_groups`.
+    const char *get_mapped_groups() const {
+        return (!m_map_groups || m_groups_str.empty()) ? nullptr : m_groups_str.c_str();
+    }
+
+    void set_map_groups(bool map_groups) {m_map_groups = map_groups;}
+
+    // Key/value pairs to export as attributes of the connection (for XRootD,
+    // XrdSecEntity attributes).
+    const std::vector<std::pair<std::string, std::string>> &get_attributes() const {return m_attributes;}
+
+    // Decisions of the chained authorizer for requests this token grants
+    // nothing for; they live (and expire) with the rules.
+    bool get_chain_decision(const std::string &key, SciTokensPrivs &privs) const {
+        std::lock_guard<std::mutex> guard(m_chain_mutex);
+        const auto iter = m_chain_decisions.find(key);
+        if (iter == m_chain_decisions.end()) {return false;}
+        privs = iter->second;
+        return true;
+    }
+
+    void put_chain_decision(const std::string &key, SciTokensPrivs privs, size_t max_entries) {
+        std::lock_guard<std::mutex> guard(m_chain_mutex);
+        if (m_chain_decisions.size() >= max_entries) {
+            m_chain_decisions.clear();
+        }
+        m_chain_decisions[key] = privs;
+    }
+
+private:
+    SciTokensPathTrie m_trie;
+    SciTokensGlobMatcher m_globs;
+    SciTokensGlobMatcher m_deny_globs;
+    std::vector<std::pair<std::string, std::string>> m_attributes;
+    std::vector<std::string> m_groups;
+    std::string m_issuer;
+    std::string m_groups_str;
+    bool m_map_groups{false};
+    mutable std::mutex m_chain_mutex;
+    std::unordered_map<std::string, SciTokensPrivs> m_chain_decisions;
+    uint64_t m_expiry_time{0};
+    const std::string m_username;
+};
+
+// Owning handle for an OpenSSL public key.
+struct SciTokensPKeyDeleter
+{
+    void operator()(EVP_PKEY *key) const;
+};
+typedef std::unique_ptr<EVP_PKEY, SciTokensPKeyDeleter> SciTokensPKey;
+
+// A public key of the native key store, prepared for verifying signatures.
+// The key's arithmetic state (e.g., the RSA Montgomery context) is computed
+// when it is loaded, and each thread keeps its own initialized verify
+// context for the key, so a verification only hashes and does the math.
+class SciTokensVerifyKey
+{
+public:
+    // Load a PEM-encoded RSA, EC, or Ed25519 public key; returns null, with
+    // `err` set, on failure.
+    static std::unique_ptr<SciTokensVerifyKey> Load(const std::string &fname, std::string &err);
+
+    // The OpenSSL key type (EVP_PKEY_RSA, EVP_PKEY_EC, or EVP_PKEY_ED25519).
+    int type() const {return m_type;}
+
+    // Verify `signature`, in the encoding OpenSSL expects (PKCS #1 for RSA,
+    // a DER ECDSA-Sig-Value for EC, raw for Ed25519), over `data`; RSA and
+    // EC signatures are over its SHA-256 digest.
+    bool verify(const char *data, size_t len, const unsigned char *signature, size_t siglen) const;
+
+private:
+    SciTokensVerifyKey(SciTokensPKey key, int type) : m_key(std::move(key)), m_type(type) {}
+
+    SciTokensPKey m_key;
+    int m_type;
+};
+
+
+// The settings of one issuer from the configuration file.
+struct SciTokensIssuer
+{
+    std::string m_name;
+    std::string m_issuer;
+    std::string m_base_path;
+    bool m_map_subject{false};
+    bool m_map_groups{false};
+    bool m_authoritative{false};
+    bool m_has_deny{false};
+    SciTokensPathTrie m_deny;
+    // The `deny` scopes with glob patterns, matched like a token's globs.
+    SciTokensGlobMatcher m_deny_globs;
+    // The key verifying token signatures in the native validator.
+    std::unique_ptr<SciTokensVerifyKey> m_public_key;
+    // Why the `public_key_file` could not be loaded, if it could not; the
+    // core's engines reject the issuer's tokens, the python engine ignores it.
+    std::string m_key_error;
+};
+
+// The issuers and group mappings of scitokens.cfg, parsed once at startup
+// into an immutable table; issuers are kept sorted by URI for lookup.
+class SciTokensIssuerTable
+{
+public:
+    // Load the INI-format configuration file; a missing file yields an empty
+    // table.  Returns false on errors reading the file.
+    bool load(const std::string &fname, SciTokensLog &log);
+
+    const SciTokensIssuer *find(const std::string &issuer) const {
+        auto iter = std::lower_bound(m_issuers.begin(), m_issuers.end(), issuer,
+                                     [](const SciTokensIssuer &entry, const std::string &value) {return entry.m_issuer < value;});
+        return (iter != m_issuers.end() && iter->m_issuer == issuer) ? &*iter : nullptr;
+    }
+
+    const std::vector<SciTokensIssuer> &issuers() const {return m_issuers;}
+
+    // Index of (issuer, group) to the privileges membership grants.
+    const std::unordered_map<std::string, SciTokensPathTrie> &groups() const {return m_groups;}
+
+private:
+    static bool get_bool(const std::string &value);
+    void load_issuer(const std::string &name, const std::map<std::string, std::string> &options, SciTokensLog &log);
+    void load_group(const std::string &name, const std::map<std::string, std::string> &options, SciTokensLog &log);
+    static bool parse_ini(std::istream &input,
+                          std::vector<std::pair<std::string, std::map<std::string, std::string>>> &sections,
+                          SciTokensLog &log);
+
+    std::vector<SciTokensIssuer> m_issuers;
+    std::unordered_map<std::string, SciTokensPathTrie> m_groups;
+};
+
+// Binds the compiled rules most recently used on a connection to an opaque
+// key of the connection (for XRootD, its XrdSecEntity).  A client typically
+// presents the same token on every request of a session; when the token
+// matches the bound one, the rules are reused without consulting the
+// (globally locked) token cache.
+//
+// Bindings live in a fixed, direct-mapped table indexed by the session key;
+// collisions and recycled sessions simply overwrite the slot.  A binding is
+// only valid for the cache epoch it was created in and until the rules expire.
+class SciTokensSessionTable
+{
+public:
+    std::shared_ptr<SciTokensRules> get(const void *session, const char *authz, size_t authz_len, uint64_t epoch)
+    {
+        Binding &binding = slot(session);
+        std::lock_guard<std::mutex> guard(binding.m_mutex);
+        if (binding.m_session != session || binding.m_epoch != epoch || !binding.m_rules) {
+            return std::shared_ptr<SciTokensRules>();
+        }
+        if (binding.m_authz.size() != authz_len || memcmp(binding.m_authz.data(), authz, authz_len)) {
+            return std::shared_ptr<SciTokensRules>();
+        }
+        if (binding.m_rules->expired()) {
+            binding.m_rules.reset();
+            return std::shared_ptr<SciTokensRules>();
+        }
+        return binding.m_rules;
+    }
+
+    void put(const void *session, const char *authz, size_t authz_len, uint64_t epoch,
+             const std::shared_ptr<SciTokensRules> &rules)
+    {
+        Binding &binding = slot(session);
+        std::lock_guard<std::mutex> guard(binding.m_mutex);
+        binding.m_session = session;
+        binding.m_epoch = epoch;
+        binding.m_authz.assign(authz, authz_len);
+        binding.m_rules = rules;
+    }
+
+private:
+    struct Binding
+    {
+        std::mutex m_mutex;
+        const void *m_session{nullptr};
+        uint64_t m_epoch{0};
+        std::string m_authz;
+        std::shared_ptr<SciTokensRules> m_rules;
+    };
+
+    Binding &slot(const void *session)
+    {
+        uintptr_t addr = reinterpret_cast<uintptr_t>(session);
+        return m_bindings[(addr ^ (addr >> 12)) % m_slots];
+    }
+
+    static constexpr size_t m_slots = 1024;
+    Binding m_bindings[m_slots];
+};
+
+// Latency statistics of a validation engine, reported periodically in the
+// log; recording is lock-free.
+class SciTokensValidatorStats
+{
+public:
+    void record(bool valid, uint64_t elapsed_ns) {
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        if (!valid) {m_rejected.fetch_add(1, std::memory_order_relaxed);}
+        m_total_ns.fetch_add(elapsed_ns, std::memory_order_relaxed);
+        uint64_t max_ns = m_max_ns.load(std::memory_order_relaxed);
+        while (elapsed_ns > max_ns && !m_max_ns.compare_exchange_weak(max_ns, elapsed_ns, std::memory_order_relaxed)) {}
+        m_buckets[bucket(elapsed_ns / 1000)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Log the statistics recorded since the last report, if any, and reset
+    // them; `elapsed` is the time since the last report, in seconds.
+    void report(const char *engine, uint64_t elapsed, SciTokensLog &log);
+
+private:
+    // Bucket 0 counts validations under 1us; bucket N, those under 2^N us.
+    static unsigned bucket(uint64_t elapsed_us) {
+        unsigned idx = 0;
+        while (elapsed_us && idx < m_nbuckets - 1) {
+            elapsed_us >>= 1;
+            idx++;
+        }
+        return idx;
+    }
+
+    static constexpr unsigned m_nbuckets = 32;
+    std::atomic<uint64_t> m_count{0};
+    std::atomic<uint64_t> m_rejected{0};
+    std::atomic<uint64_t> m_total_ns{0};
+    std::atomic<uint64_t> m_max_ns{0};
+    std::atomic<uint64_t> m_buckets[m_nbuckets] = {};
+};
+
+// A token validation engine: validates the token presented in an
+// authorization value and extracts the ACLs and claims it carries.
+class SciTokensValidator
+{
+public:
+    virtual ~SciTokensValidator() {}
+
+    // The name of the engine, as selected by the plugin's `engine` parameter.
+    virtual const char *Name() const = 0;
+
+    // Prepare to validate tokens of the issuers in `issuers`, which outlives
+    // the validator; called once the configuration is loaded.  Returns false
+    // if the engine cannot be used.
+    virtual bool Init(const SciTokensIssuerTable &issuers, SciTokensLog &log) = 0;
+
+    // `authz` is the authorization as presented by the client (e.g.,
+    // "Bearer%20<token>").  Returns false if the token is invalid; a value
+    // that holds no token, or a token of an unknown issuer, yields no ACLs.
+    virtual bool Validate(const char *authz, SciTokensInfo &info) = 0;
+
+    // Validate() and record its latency, excluding any wait for a slot or
+    // pool thread, in Stats().
+    bool TimedValidate(const char *authz, SciTokensInfo &info) {
+        auto start = std::chrono::steady_clock::now();
+        bool valid = Validate(authz, info);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        m_stats.record(valid, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        return valid;
+    }
+
+    SciTokensValidatorStats &Stats() {return m_stats;}
+
+    // The core's engine named `engine`: native, stub, or worker (running
+    // `worker_program` on `config_file` in `workers` processes); nullptr
+    // for any other name.
+    static std::unique_ptr<SciTokensValidator> Make(const std::string &engine, const std::string &worker_program,
+                                                    const std::string &config_file, unsigned workers);
+
+private:
+    SciTokensValidatorStats m_stats;
+};
+
+// Validates tokens in-process against the `public_key_file` of their issuer.
+class SciTokensNativeValidator : public SciTokensValidator
+{
+public:
+    virtual const char *Name() const {return "native";}
+    virtual bool Init(const SciTokensIssuerTable &issuers, SciTokensLog &log);
+    virtual bool Validate(const char *authz, SciTokensInfo &info);
+
+protected:
+    const SciTokensIssuerTable *m_issuers{nullptr};
+    SciTokensLog *m_log{nullptr};
+};
+
+// Offline test engine: applies the checks of the native engine except for
+// the signature, so tokens may be minted without the issuers' keys.  Never
+// use it in production.
+class SciTokensStubValidator : public SciTokensNativeValidator
+{
+public:
+    virtual const char *Name() const {return "stub";}
+    virtual bool Init(const SciTokensIssuerTable &issuers, SciTokensLog &log);
+    virtual bool Validate(const char *authz, SciTokensInfo &info);
+};
+
+// Validates tokens natively in a pool of worker processes (the
+// xrootd-scitokens-worker program), isolating the server from the parsing
+// and cryptography of untrusted tokens.  A worker that fails or does not
+// answer in time is replaced.
+class SciTokensWorkerValidator : public SciTokensValidator
+{
+public:
+    SciTokensWorkerValidator(const std::string &program, const std::string &config_file, unsigned workers) :
+        m_program(program),
+        m_config_file(config_file),
+        m_workers(workers ? workers : 1)
+    {}
+
+    virtual ~SciTokensWorkerValidator();
+
+    virtual const char *Name() const {return "worker";}
+    virtual bool Init(const SciTokensIssuerTable &issuers, SciTokensLog &log);
+    virtual bool Validate(const char *authz, SciTokensInfo &info);
+
+    // The worker side of the protocol: announce readiness on `fd`, then
+    // answer each frame holding an authorization with a frame holding the
+    // encoded SciTokensInfo, or an empty frame if the token is invalid.
+    // Returns when `fd` is closed.
+    static int Serve(int fd, const std::string &config_file, SciTokensLog &log);
+
+private:
+    struct Worker
+    {
+        int m_pid{-1};
+        int m_fd{-1};
+    };
+
+    bool Spawn(Worker &worker);
+    void Stop(Worker &worker);
+
+    static bool ReadFrame(int fd, std::string &frame, int timeout_ms);
+    static bool WriteFrame(int fd, const std::string &frame);
+    static std::string EncodeInfo(const SciTokensInfo &info);
+    static bool DecodeInfo(const std::string &data, SciTokensInfo &info);
+
+    std::string m_program;
+    std::string m_config_file;
+    unsigned m_workers;
+    SciTokensLog *m_log{nullptr};
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::vector<Worker> m_pool;
+    std::vector<size_t> m_idle;
+
+    static constexpr int m_timeout_ms = 10000;
+    static constexpr uint32_t m_max_frame = 1 << 20;
+};
+
+// Logs to stderr, for programs embedding the core outside of XRootD.
+class SciTokensStderrLog : public SciTokensLog
+{
+public:
+    virtual void Say(const char *text1, const char *text2, const char *text3, const char *text4,
+                     const char *text5, const char *text6);
+    virtual void Emsg(const char *esfx, const char *text1, const char *text2, const char *text3);
+    virtual int Emsg(const char *esfx, int ecode, const char *text1, const char *text2);
+};
+
+// The authorization a request falls back to when no token grants it (for
+// XRootD, the chained authorizer), for a single request.
+class SciTokensChain
+{
+public:
+    virtual ~SciTokensChain() {}
+
+    // The privileges granted to the request.
+    virtual SciTokensPrivs Access() = 0;
+
+    // The inputs Access() decides on; requests with equal keys get the same
+    // privileges.  Use MakeKey().
+    virtual std::string Key() const = 0;
+
+    // The key of a request by the client with the given security protocol
+    // and identity (name, host, VO, role, groups...) for `op` on `path`.
+    static std::string MakeKey(const std::string &prot, std::initializer_list<const char *> identity, int op,
+                               const char *path) {
+        std::string key = prot;
+        for (const char *field : identity) {
+            key.push_back('\0');
+            if (field) {key += field;}
+        }
+        key.push_back('\0');
+        key += std::to_string(op);
+        key.push_back('\0');
+        key += path;
+        return key;
+    }
+};
+
+class SciTokensAuthorizer;
+
+// Shadow mode: re-validates a sample of the tokens validated by the primary
+// engine with a second engine, in a background thread off the request path,
+// and reports where the results differ (validity, expiry, username, claims,
+// or compiled rules).  The shadow result is never used for authorization.
+class SciTokensShadow
+{
+public:
+    SciTokensShadow(const SciTokensAuthorizer &core, std::unique_ptr<SciTokensValidator> validator, double fraction,
+                    SciTokensLog &log);
+    ~SciTokensShadow();
+
+    // Initialize the shadow engine and start the background thread.
+    bool Init(const SciTokensIssuerTable &issuers);
+
+    // Queue `authz` for shadow validation if it is sampled; `primary` holds
+    // the rules compiled from the primary engine's result, or is null if the
+    // primary engine rejected the token.
+    void Submit(const char *authz, const std::shared_ptr<SciTokensRules> &primary);
+
+    // Log the comparisons made since the last report, if any.
+    void Report(uint64_t elapsed);
+
+    // Wait until the queued tokens have been compared.
+    void Drain();
+
+private:
+    struct Task
+    {
+        std::string m_authz;
+        std::shared_ptr<SciTokensRules> m_primary;
+    };
+
+    void Run();
+    void Compare(const Task &task);
+
+    const SciTokensAuthorizer &m_core;
+    std::unique_ptr<SciTokensValidator> m_validator;
+    double m_fraction;
+    SciTokensLog &m_log;
+    std::atomic<uint64_t> m_submitted{0};
+    std::atomic<uint64_t> m_compared{0};
+    std::atomic<uint64_t> m_mismatched{0};
+    std::atomic<uint64_t> m_dropped{0};
+    std::atomic<unsigned> m_logged{0};
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<Task> m_queue;
+    bool m_comparing{false};
+    bool m_stop{false};
+    std::thread m_thread;
+
+    static constexpr size_t m_max_queue = 1024;
+    // At most this many mismatches are logged between reports.
+    static constexpr unsigned m_max_logged = 10;
+    // Expiry times may differ by this many seconds, as the engines validate
+    // the token at different times.
+    static constexpr uint64_t m_expiry_tolerance = 2;
+};
+
+// A fixed-size pool of threads validating tokens on behalf of the request
+// threads, so validation crypto never runs on more threads than the pool
+// has.  Each pool thread owns a deque of tasks: submissions are spread over
+// the deques round-robin, and a thread serves its own deque from the front
+// and, once it is empty, steals from the back of the others.  The request
+// thread parks until its token is validated; if no pool thread has started
+// on it by the request's deadline, the request thread takes it back
+// unvalidated rather than validating it inline, so validation never runs
+// on more threads than the pool has.
+class SciTokensValidationPool
+{
+public:
+    SciTokensValidationPool(SciTokensValidator &validator, unsigned threads, unsigned deadline_ms);
+    ~SciTokensValidationPool();
+
+    // Validate `authz` with the pool's validator; see SciTokensValidator::Validate().
+    // If no pool thread started on it by `deadline`, `expired` is set and
+    // false returned without validating it.
+    bool Validate(const char *authz, SciTokensInfo &info, std::chrono::steady_clock::time_point deadline,
+                  bool &expired);
+
+    // Log the tokens validated since the last report, if any.
+    void Report(uint64_t elapsed, SciTokensLog &log);
+
+private:
+    struct Task
+    {
+        enum State {Queued, Running, Done};
+
+        // Valid while the state is Queued or Running: the submitting thread
+        // waits until the task is done or takes it back.
+        const char *m_authz;
+        SciTokensInfo m_info;
+        bool m_valid{false};
+        std::atomic<int> m_state{Queued};
+        std::mutex m_mutex;
+        std::condition_variable m_cond;
+    };
+
+    struct Queue
+    {
+        std::mutex m_mutex;
+        std::deque<std::shared_ptr<Task>> m_tasks;
+    };
+
+    void Run(size_t idx);
+    std::shared_ptr<Task> Take(size_t idx);
+
+    SciTokensValidator &m_validator;
+    std::chrono::milliseconds m_deadline;
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::atomic<size_t> m_next{0};
+    std::atomic<size_t> m_pending{0};
+    std::atomic<uint64_t> m_validated{0};
+    std::atomic<uint64_t> m_stolen{0};
+    std::atomic<uint64_t> m_expired{0};
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    bool m_stop{false};
+    std::vector<std::thread> m_threads;
+};
+
+// Admits the validations of uncached tokens to the engine, at most `slots`
+// at a time.  When every slot is busy, tokens wait in a queue per issuer and
+// freed slots go to the issuers' queues in turn (deficit round-robin with
+// equal costs), so a burst of one issuer's tokens only delays that issuer.
+// The queue never holds a request past its deadline: a token still waiting
+// then leaves the queue unvalidated, and its request is decided without it.
+class SciTokensFairQueue
+{
+public:
+    SciTokensFairQueue(unsigned slots, unsigned deadline_ms) :
+        m_slots(slots ? slots : 1),
+        m_deadline(deadline_ms)
+    {}
+
+    // Take a free slot if no token is waiting; returns false otherwise.
+    bool TryAcquire() {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        if (m_busy >= m_slots || !m_turns.empty()) {return false;}
+        m_busy++;
+        return true;
+    }
+
+    // Wait until `deadline` for a slot to validate a token of `issuer`;
+    // returns false, holding no slot, if none was free by then.
+    bool Acquire(const std::string &issuer, std::chrono::steady_clock::time_point deadline);
+
+    // Release the slot of a validation that completed.
+    void Release();
+
+    // Log the tokens that waited past the deadline since the last report, if any.
+    void Report(uint64_t elapsed, SciTokensLog &log);
+
+private:
+    struct Waiter
+    {
+        std::condition_variable m_cond;
+        bool m_admitted{false};
+    };
+
+    std::mutex m_mutex;
+    unsigned m_slots;
+    std::chrono::milliseconds m_deadline;
+    unsigned m_busy{0};
+    std::atomic<uint64_t> m_expired{0};
+    // The waiting tokens of each issuer with any; issuers are served in the
+    // order of m_turns.
+    std::unordered_map<std::string, std::deque<Waiter *>> m_queues;
+    std::deque<std::string> m_turns;
+};
+
+// The authorization core: the issuer table, the validator, and the cache of
+// rules compiled from validated tokens.
+class SciTokensAuthorizer
+{
+public:
+    SciTokensAuthorizer(SciTokensLog &log) :
+        m_next_clean(monotonic_time() + m_expiry_secs),
+        m_last_report(monotonic_time()),
+        m_log(log)
+    {}
+
+    // Load the issuers and group mappings of the configuration file and
+    // initialize the validator; returns false on errors reading the file or
+    // if the validator cannot be used.  Tokens are validated natively unless
+    // a validator is set.
+    bool Config(const std::string &config_file);
+
+    // Select the validation engine; must be called before Config().
+    void SetValidator(std::unique_ptr<SciTokensValidator> validator) {m_validator = std::move(validator);}
+
+    const SciTokensValidator *Validator() const {return m_validator.get();}
+
+    // Compare the primary engine with `validator` on `fraction` of the
+    // validated tokens (see SciTokensShadow); must be called before Config().
+    void SetShadow(std::unique_ptr<SciTokensValidator> validator, double fraction) {
+        m_shadow_validator = std::move(validator);
+        m_shadow_fraction = fraction;
+    }
+
+    // Validate tokens in a SciTokensValidationPool of `threads` threads
+    // (none: on the request threads) with the given deadline, admitted
+    // through a SciTokensFairQueue with a slot per thread; must be called
+    // before Config().
+    void SetValidationPool(unsigned threads, unsigned deadline_ms) {
+        m_pool_threads = threads;
+        m_pool_deadline_ms = deadline_ms;
+    }
+
+    // Resolve mapped usernames to Unix identities when tokens are validated.
+    void SetResolveIdentity(bool resolve_identity) {m_resolve_identity = resolve_identity;}
+
+    // Cache up to `max_entries` fallback decisions per token (none if 0).
+    void SetChainCache(size_t max_entries) {m_chain_cache_size = max_entries;}
+
+    const SciTokensIssuerTable &Issuers() const {return m_issuers;}
+
+    // Return the rules of the token in `authz`, validating and compiling it
+    // if it is not cached; nullptr if the token is invalid.  `session` is an
+    // opaque key of the client connection (or nullptr); `rebound` is set when
+    // the connection was not already bound to these rules, i.e., when rules
+    // attributes need to be attached to the connection again.  Also nullptr,
+    // without caching, if the token got no validation slot by the deadline.
+    std::shared_ptr<SciTokensRules> Lookup(const void *session, const char *authz, bool &rebound);
+
+    // Compile a validated token into rules, merging the issuer's deny rules
+    // and the grants of the token's groups; the rules are not cached.
+    std::shared_ptr<SciTokensRules> Compile(const SciTokensInfo &info) const;
+
+    // Whether `path` lies in the namespace of an authoritative issuer, where
+    // the token is the only source of authorization.
+    bool Authoritative(const char *path) const {return m_authoritative.covers(path);}
+
+    // Decide a request for `path` that no token grants with `chain`, unless
+    // the path is Authoritative(), where it is denied.  `rules` are those of
+    // the request's token, if any; they cache the decisions of the chain
+    // when SetChainCache() enabled it.
+    SciTokensPrivs Chain(SciTokensChain &chain, const char *path, SciTokensRules *rules=nullptr) const;
+
+private:
+    void Check(uint64_t now);
+
+    // The fair queueing flow of the token in `authz`: its issuer, as claimed
+    // before the token is validated, if it is configured; otherwise the flow
+    // shared by every unknown issuer and undecodable token, so forged
+    // issuers do not earn more turns.
+    std::string Flow(const char *authz) const;
+
+    std::mutex m_mutex;
+    std::map<std::string, std::shared_ptr<SciTokensRules>> m_map;
+    SciTokensIssuerTable m_issuers;
+    SciTokensPrefixIndex m_authoritative;
+    std::atomic<uint64_t> m_epoch{0};
+    SciTokensSessionTable m_sessions;
+    std::unique_ptr<SciTokensValidator> m_validator;
+    uint64_t m_next_clean{0};
+    uint64_t m_last_report{0};
+    bool m_resolve_identity{false};
+    size_t m_chain_cache_size{0};
+    std::unique_ptr<SciTokensValidator> m_shadow_validator;
+    double m_shadow_fraction{0};
+    unsigned m_pool_threads{0};
+    unsigned m_pool_deadline_ms{0};
+    std::unique_ptr<SciTokensFairQueue> m_fair_queue;
+    // Destroyed first: the pool and shadow threads use the members above.
+    std::unique_ptr<SciTokensValidationPool> m_pool;
+    std::unique_ptr<SciTokensShadow> m_shadow;
+    SciTokensLog &m_log;
+
+    static constexpr uint64_t m_expiry_secs = 60;
+};
+
+#endif
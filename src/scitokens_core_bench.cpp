@@ -0,0 +1,219 @@
+// Micro-benchmarks of the SciTokens authorization core, built without XRootD
+// when SCITOKENS_BENCHMARKS is ON:
+//
+//   scitokens-core-bench
+//
+// Each benchmark reports the mean cost of one operation; the fastest of a few
+// rounds is reported.
+
+#include "scitokens_core.h"
+#include "scitokens_signing.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *g_rsa_issuer = "https://rsa.bench.example";
+static const char *g_ec_issuer = "https://ec.bench.example";
+static const char *g_ed_issuer = "https://ed.bench.example";
+
+// The number of rounds of each benchmark; the fastest is reported.
+static const int g_rounds = 5;
+
+
+// Run `op` `count` times per round and print the mean cost per call of the
+// fastest round, in nanoseconds.
+static void Bench(const char *name, size_t count, const std::function<void(size_t)> &op)
+{
+    double best = 0;
+    for (int round = 0; round < g_rounds; round++) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t idx = 0; idx < count; idx++) {
+            op(idx);
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        double cost = std::chrono::duration<double, std::nano>(elapsed).count() / count;
+        best = round ? std::min(best, cost) : cost;
+    }
+    printf("%-24s %12.1f ns/op\n", name, best);
+}
+
+
+// The claims of a token of `issuer` for the user `user`.
+static std::string Claims(const char *issuer, const std::string &user, size_t idx)
+{
+    long exp = time(nullptr) + 3600;
+    return "{\"iss\":\"" + std::string(issuer) + "\",\"sub\":\"" + user + "\",\"exp\":" + std::to_string(exp) +
+           ",\"iat\":" + std::to_string(exp - 3600) + ",\"jti\":\"" + std::to_string(idx) + "\"" +
+           ",\"scope\":\"storage.read:/ storage.modify:/home/" + user + " storage.create:/runs/run-*\"" +
+           ",\"wlcg.groups\":[\"/cms\",\"/cms/production\"]}";
+}
+
+
+int main()
+{
+    char dir_template[] = "/tmp/scitokens-core-bench.XXXXXX";
+    if (!mkdtemp(dir_template)) {
+        perror("Unable to create the benchmark directory");
+        return 1;
+    }
+    std::string dir(dir_template);
+    EVP_PKEY *rsa = GenerateKey(EVP_PKEY_RSA);
+    EVP_PKEY *ec = GenerateKey(EVP_PKEY_EC);
+    EVP_PKEY *ed = GenerateKey(EVP_PKEY_ED25519);
+    if (!rsa || !ec || !ed || !WritePublicKey(rsa, dir + "/rsa.pem") || !WritePublicKey(ec, dir + "/ec.pem") ||
+        !WritePublicKey(ed, dir + "/ed.pem")) {
+        fprintf(stderr, "Unable to generate the benchmark keys\n");
+        return 1;
+    }
+    std::string config = dir + "/scitokens.cfg";
+    FILE *fp = fopen(config.c_str(), "w");
+    if (!fp) {
+        perror("Unable to write the benchmark configuration");
+        return 1;
+    }
+    fprintf(fp, "[Issuer RSA]\nissuer = %s\nbase_path = /rsa\npublic_key_file = %s/rsa.pem\n\n"
+                "[Issuer EC]\nissuer = %s\nbase_path = /ec\ndeny = storage.modify:/protected\n"
+                "public_key_file = %s/ec.pem\n\n"
+                "[Issuer ED]\nissuer = %s\nbase_path = /ed\npublic_key_file = %s/ed.pem\n\n"
+                "[Group CMS]\nissuer = %s\ngroup = /cms/production\npath = /store/cms/production\nauthz = read, write\n",
+            g_rsa_issuer, dir.c_str(), g_ec_issuer, dir.c_str(), g_ed_issuer, dir.c_str(), g_ec_issuer);
+    fclose(fp);
+
+    SciTokensStderrLog log;
+    SciTokensAuthorizer authz(log);
+    bool configured = authz.Config(config);
+    for (const char *fname : {"/rsa.pem", "/ec.pem", "/ed.pem", "/scitokens.cfg"}) {
+        unlink((dir + fname).c_str());
+    }
+    rmdir(dir.c_str());
+    if (!configured) {
+        fprintf(stderr, "Unable to configure the authorization core\n");
+        return 1;
+    }
+
+    // The rules of a token with several grants, with and without globs.
+    SciTokensInfo info;
+    info.m_issuer = g_ec_issuer;
+    info.m_subject = "user1";
+    info.m_groups = {"/cms", "/cms/production"};
+    for (int idx = 0; idx < 16; idx++) {
+        info.m_acls.emplace_back(SciTokensOp_Read, "/ec/data/set" + std::to_string(idx));
+        info.m_acls.emplace_back(SciTokensOp_Update, "/ec/home/user" + std::to_string(idx));
+    }
+    SciTokensInfo glob_info = info;
+    for (int idx = 0; idx < 8; idx++) {
+        glob_info.m_acls.emplace_back(SciTokensOp_Create, "/ec/runs/run-" + std::to_string(idx) + "*/out-*");
+    }
+    std::shared_ptr<SciTokensRules> rules = authz.Compile(info);
+    std::shared_ptr<SciTokensRules> glob_rules = authz.Compile(glob_info);
+    std::vector<std::string> paths;
+    for (int idx = 0; idx < 64; idx++) {
+        paths.push_back("/ec/" + std::string(idx % 2 ? "data/set" : "runs/run-") + std::to_string(idx % 16) +
+                        "/out-" + std::to_string(idx) + "/file");
+    }
+
+    std::vector<std::string> tokens;
+    for (size_t idx = 0; idx < 64; idx++) {
+        tokens.push_back(SignToken(idx % 2 ? ec : rsa, Claims(idx % 2 ? g_ec_issuer : g_rsa_issuer,
+                                                              "user" + std::to_string(idx), idx)));
+    }
+    std::vector<char> sessions(tokens.size());
+    std::vector<std::string> ed_tokens;
+    for (size_t idx = 0; idx < 32; idx++) {
+        ed_tokens.push_back(SignToken(ed, Claims(g_ed_issuer, "user" + std::to_string(idx), idx)));
+    }
+
+    size_t granted = 0;
+    Bench("test (op privs)", 10000000, [&](size_t idx) {
+        granted += OpPermitted(static_cast<int>(idx & SciTokensPriv_All), static_cast<int>(idx % 16));
+    });
+    Bench("trie apply", 1000000, [&](size_t idx) {
+        granted += rules->apply(SciTokensOp_Read, paths[idx % paths.size()].c_str()) != SciTokensPriv_None;
+    });
+    Bench("glob apply", 1000000, [&](size_t idx) {
+        granted += glob_rules->apply(SciTokensOp_Create, paths[idx % paths.size()].c_str()) != SciTokensPriv_None;
+    });
+    // The glob matcher alone, against the reference matching each pattern in turn.
+    SciTokensGlobMatcher globs;
+    for (int idx = 0; idx < 8; idx++) {
+        globs.add("/ec/runs/run-" + std::to_string(idx) + "*/out-*", SciTokensOp_Create);
+    }
+    globs.compile();
+    Bench("glob match (DFA)", 1000000, [&](size_t idx) {
+        granted += globs.match(paths[idx % paths.size()].c_str()) != SciTokensPriv_None;
+    });
+    Bench("glob match (naive)", 1000000, [&](size_t idx) {
+        granted += globs.match_naive(paths[idx % paths.size()].c_str()) != SciTokensPriv_None;
+    });
+    Bench("compile", 20000, [&](size_t) {
+        granted += static_cast<bool>(authz.Compile(info));
+    });
+    Bench("compile (globs)", 20000, [&](size_t) {
+        granted += static_cast<bool>(authz.Compile(glob_info));
+    });
+    // A pattern set no earlier token had, so its DFA is built.
+    size_t cold = 0;
+    Bench("compile (new globs)", 100, [&](size_t) {
+        SciTokensInfo cold_info = glob_info;
+        cold_info.m_acls.emplace_back(SciTokensOp_Read, "/ec/cold/" + std::to_string(cold++) + "/*");
+        granted += static_cast<bool>(authz.Compile(cold_info));
+    });
+    bool rebound;
+    Bench("lookup (session hit)", 1000000, [&](size_t idx) {
+        size_t client = idx % tokens.size();
+        granted += static_cast<bool>(authz.Lookup(&sessions[client], tokens[client].c_str(), rebound));
+    });
+    Bench("lookup (cache hit)", 1000000, [&](size_t idx) {
+        size_t client = idx % tokens.size();
+        granted += static_cast<bool>(authz.Lookup(&sessions[client], tokens[(idx / 7) % tokens.size()].c_str(),
+                                                  rebound));
+    });
+    // The signature verification alone, with the issuers' prepared keys.
+    std::string signing_input = tokens[0].substr(0, tokens[0].rfind('.'));
+    struct {
+        const char *m_name;
+        const char *m_issuer;
+        EVP_PKEY *m_key;
+    } verifications[] = {{"verify (RS256)", g_rsa_issuer, rsa}, {"verify (ES256)", g_ec_issuer, ec},
+                         {"verify (EdDSA)", g_ed_issuer, ed}};
+    for (const auto &verification : verifications) {
+        const SciTokensVerifyKey &key = *authz.Issuers().find(verification.m_issuer)->m_public_key;
+        std::string signature = Sign(verification.m_key, signing_input);
+        Bench(verification.m_name, 2000, [&](size_t) {
+            granted += key.verify(signing_input.data(), signing_input.size(),
+                                  reinterpret_cast<const unsigned char *>(signature.data()), signature.size());
+        });
+    }
+    SciTokensNativeValidator validator;
+    validator.Init(authz.Issuers(), log);
+    Bench("validate (RS256)", 2000, [&](size_t idx) {
+        SciTokensInfo token_info;
+        granted += validator.Validate(tokens[(2 * idx) % tokens.size()].c_str(), token_info);
+    });
+    Bench("validate (ES256)", 2000, [&](size_t idx) {
+        SciTokensInfo token_info;
+        granted += validator.Validate(tokens[(2 * idx + 1) % tokens.size()].c_str(), token_info);
+    });
+    Bench("validate (EdDSA)", 2000, [&](size_t idx) {
+        SciTokensInfo token_info;
+        granted += validator.Validate(ed_tokens[idx % ed_tokens.size()].c_str(), token_info);
+    });
+
+    EVP_PKEY_free(rsa);
+    EVP_PKEY_free(ec);
+    EVP_PKEY_free(ed);
+    if (!granted) {
+        fprintf(stderr, "No operation was authorized\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,992 @@
+// Unit tests of the SciTokens authorization core, built without XRootD when
+// SCITOKENS_TESTS is ON and run by `ctest`:
+//
+//   scitokens-core-test
+//
+// Each test prints the checks that failed; the program exits non-zero if any
+// did.
+
+#include "scitokens_core.h"
+#include "scitokens_parse.h"
+#include "scitokens_signing.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <ctime>
+#include <random>
+#include <string>
+#include <thread>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+static int g_failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            g_failures++; \
+        } \
+    } while (0)
+
+
+// Discards the core's messages.
+class QuietLog : public SciTokensLog
+{
+public:
+    virtual void Say(const char *, const char *, const char *, const char *, const char *, const char *) {}
+    virtual void Emsg(const char *, const char *, const char *, const char *) {}
+    virtual int Emsg(const char *, int ecode, const char *, const char *) {return ecode;}
+};
+
+
+// A random string of up to `max_len` characters, mostly drawn from
+// `alphabet` (the characters the routine under test treats specially).
+static std::string RandomString(std::mt19937 &rng, const std::string &alphabet, size_t max_len)
+{
+    std::string result(rng() % (max_len + 1), '\0');
+    for (auto &c : result) {
+        c = (rng() % 8) ? alphabet[rng() % alphabet.size()] : static_cast<char>(rng() % 255 + 1);
+    }
+    return result;
+}
+
+
+// Keeps the core's informational messages.
+class RecordingLog : public QuietLog
+{
+public:
+    virtual void Say(const char *msg1, const char *msg2, const char *msg3, const char *msg4, const char *msg5,
+                     const char *msg6) {
+        std::string msg;
+        for (const char *part : {msg1, msg2, msg3, msg4, msg5, msg6}) {
+            if (part) {msg += part;}
+        }
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_messages.push_back(msg);
+    }
+
+    // Whether any message contains `text`.
+    bool Contains(const std::string &text) {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        for (const auto &msg : m_messages) {
+            if (msg.find(text) != std::string::npos) {return true;}
+        }
+        return false;
+    }
+
+private:
+    std::mutex m_mutex;
+    std::vector<std::string> m_messages;
+};
+
+
+// Configure `authz` from the given contents of scitokens.cfg.
+static bool Configure(SciTokensAuthorizer &authz, const std::string &contents)
+{
+    char config[] = "/tmp/scitokens-core-test.XXXXXX";
+    int fd = mkstemp(config);
+    if (fd < 0) {return false;}
+    bool written = write(fd, contents.data(), contents.size()) == static_cast<ssize_t>(contents.size());
+    close(fd);
+    bool configured = written && authz.Config(config);
+    unlink(config);
+    return configured;
+}
+
+
+// Three issuers, https://rsa, https://ec and https://ed, whose keys sign
+// RS256, ES256 and EdDSA tokens; their public keys are written to a temporary
+// directory for the issuers' public_key_file.
+class TestIssuers
+{
+public:
+    TestIssuers() {
+        char dir[] = "/tmp/scitokens-core-test.XXXXXX";
+        if (mkdtemp(dir)) {m_dir = dir;}
+        for (const auto &key : {std::make_pair(&m_rsa, EVP_PKEY_RSA), std::make_pair(&m_ec, EVP_PKEY_EC),
+                                std::make_pair(&m_ed, EVP_PKEY_ED25519)}) {
+            *key.first = GenerateKey(key.second);
+        }
+        m_ready = !m_dir.empty() && m_rsa && m_ec && m_ed && WritePublicKey(m_rsa, m_dir + "/rsa.pem") &&
+                  WritePublicKey(m_ec, m_dir + "/ec.pem") && WritePublicKey(m_ed, m_dir + "/ed.pem");
+    }
+
+    ~TestIssuers() {
+        for (const char *fname : {"/rsa.pem", "/ec.pem", "/ed.pem"}) {
+            unlink((m_dir + fname).c_str());
+        }
+        if (!m_dir.empty()) {rmdir(m_dir.c_str());}
+        EVP_PKEY_free(m_rsa);
+        EVP_PKEY_free(m_ec);
+        EVP_PKEY_free(m_ed);
+    }
+
+    // The configuration of the three issuers, with base path /stash and the
+    // given extra options, followed by `sections`.
+    std::string Config(const std::string &options="", const std::string &sections="") const {
+        std::string config;
+        for (const char *name : {"rsa", "ec", "ed"}) {
+            config += std::string("[Issuer ") + name + "]\nissuer = https://" + name + "\nbase_path = /stash\n" +
+                      "public_key_file = " + m_dir + "/" + name + ".pem\n" + options + "\n";
+        }
+        return config + sections;
+    }
+
+    // The authorization of a token signed by `key` for the issuer of that
+    // key, with the given additional claims.
+    std::string Token(EVP_PKEY *key, const std::string &claims) const {
+        const char *issuer = key == m_rsa ? "https://rsa" : key == m_ec ? "https://ec" : "https://ed";
+        return SignToken(key, std::string("{\"iss\":\"") + issuer + "\",\"exp\":" +
+                              std::to_string(time(nullptr) + 600) + (claims.empty() ? "" : ",") + claims + "}");
+    }
+
+    bool m_ready{false};
+    std::string m_dir;
+    EVP_PKEY *m_rsa{nullptr};
+    EVP_PKEY *m_ec{nullptr};
+    EVP_PKEY *m_ed{nullptr};
+};
+
+// Shared by the tests, as generating the RSA key is slow.
+static const TestIssuers &Issuers()
+{
+    static const TestIssuers issuers;
+    return issuers;
+}
+
+
+// The rules of a token of `issuer` granting `ops` on `path`, in `groups`.
+static std::shared_ptr<SciTokensRules> Rules(const SciTokensAuthorizer &authz, const std::string &issuer,
+                                             std::initializer_list<SciTokensOp> ops, const std::string &path,
+                                             std::vector<std::string> groups={})
+{
+    SciTokensInfo info;
+    info.m_issuer = issuer;
+    info.m_groups = groups;
+    for (const auto op : ops) {
+        info.m_acls.emplace_back(op, path);
+    }
+    return authz.Compile(info);
+}
+
+
+// The privileges each operation requires, and whether the privilege sets of
+// typical grants permit it.
+static void TestOpPermitted()
+{
+    static const struct {
+        int m_op;
+        int m_privs;
+        bool m_permitted;
+    } cases[] = {
+        {SciTokensOp_Any, SciTokensPriv_None, true},
+        {SciTokensOp_Read, SciTokensPriv_Read, true},
+        {SciTokensOp_Read, SciTokensPriv_Lookup, false},
+        {SciTokensOp_Stat, SciTokensPriv_Lookup, true},
+        {SciTokensOp_Stat, SciTokensPriv_Read, false},
+        {SciTokensOp_Readdir, SciTokensPriv_Read, true},
+        {SciTokensOp_Create, SciTokensPriv_Create, true},
+        {SciTokensOp_Create, SciTokensPriv_Update, false},
+        {SciTokensOp_Create, SciTokensPriv_Insert, false},
+        {SciTokensOp_Update, SciTokensPriv_Create, true},
+        {SciTokensOp_Update, SciTokensPriv_Write, false},
+        {SciTokensOp_Mkdir, SciTokensPriv_Insert, true},
+        {SciTokensOp_Insert, SciTokensPriv_Create, true},
+        {SciTokensOp_Delete, SciTokensPriv_Delete, true},
+        {SciTokensOp_Delete, SciTokensPriv_All & ~SciTokensPriv_Delete, false},
+        {SciTokensOp_Rename, SciTokensPriv_Rename, true},
+        {SciTokensOp_Lock, SciTokensPriv_Lock, true},
+        {SciTokensOp_Chmod, SciTokensPriv_Create, false},
+        {SciTokensOp_Chown, SciTokensPriv_All, true},
+        {SciTokensOp_Last + 1, SciTokensPriv_All, false},
+        {-1, SciTokensPriv_All, false},
+    };
+    for (const auto &test : cases) {
+        if (OpPermitted(test.m_privs, test.m_op) != test.m_permitted) {
+            fprintf(stderr, "OpPermitted(0x%x, %d) != %d\n", test.m_privs, test.m_op, test.m_permitted);
+            g_failures++;
+        }
+    }
+    // A grant of an operation's own privileges permits it, and every
+    // privilege it requires is needed.
+    for (int op = SciTokensOp_Any; op <= SciTokensOp_Last; op++) {
+        int need = OpPrivs(static_cast<SciTokensOp>(op));
+        CHECK(OpPermitted(need, op));
+        CHECK(OpPermitted(SciTokensPriv_All, op));
+        CHECK(AddPriv(static_cast<SciTokensOp>(op), SciTokensPriv_None) == need);
+        for (int bit = 1; bit <= SciTokensPriv_All; bit <<= 1) {
+            if (need & bit) {CHECK(!OpPermitted(need & ~bit, op));}
+        }
+    }
+    CHECK(OpPrivs(static_cast<SciTokensOp>(SciTokensOp_Last + 1)) == SciTokensPriv_None);
+}
+
+
+// The glob DFA agrees with the reference matcher, including when it comes
+// from the cache of another matcher with the same patterns.
+static void TestGlobMatcher()
+{
+    const char *patterns[] = {"/data/run-*/out-?", "/data/run-1*", "/user/*/public", "/x?z"};
+    const char *paths[] = {"/data/run-12/out-3", "/data/run-12/out-33", "/data/run-1", "/data/run-2/out-1/f",
+                           "/data/run-/out-x", "/user/alice/public", "/user/alice/private", "/user//bob/public/f",
+                           "/xyz", "/xz", "/xyz/../etc", "/data/run-9/../run-1", "/", ""};
+    SciTokensGlobMatcher forward, backward;
+    for (size_t idx = 0; idx < 4; idx++) {
+        forward.add(patterns[idx], idx % 2 ? SciTokensOp_Read : SciTokensOp_Update);
+        backward.add(patterns[3 - idx], idx % 2 ? SciTokensOp_Update : SciTokensOp_Read);
+    }
+    forward.compile();
+    backward.compile();
+    CHECK(forward.same_patterns(backward));
+    for (const char *path : paths) {
+        CHECK(forward.match(path) == forward.match_naive(path));
+        CHECK(backward.match(path) == forward.match(path));
+    }
+    CHECK(forward.match("/data/run-12/out-3") == (OpBit(SciTokensOp_Update) | OpBit(SciTokensOp_Read)));
+    CHECK(forward.match("/data/run-22/out-3/file") == OpBit(SciTokensOp_Update));
+    CHECK(forward.match("/user/alice/private") == 0);
+    CHECK(forward.match("/xyz/../etc") == 0);
+}
+
+
+// The parsers agree with their reference implementations on random input.
+static void TestParsers()
+{
+    std::mt19937 rng(1);
+    for (int iteration = 0; iteration < 20000; iteration++) {
+        std::string input = RandomString(rng, "%0aF9g", 12), output, reference;
+        bool valid = PercentDecode(input.data(), input.size(), output);
+        CHECK(PercentDecodeReference(input, reference) == valid && (!valid || output == reference));
+
+        input = RandomString(rng, "Az09-_=+/", 12);
+        valid = Base64UrlDecode(input.data(), input.size(), output);
+        CHECK(Base64UrlDecodeReference(input, reference) == valid && (!valid || output == reference));
+
+        input = RandomString(rng, "/./..a", 16);
+        std::string normalized = NormalizePath(input);
+        CHECK(normalized == NormalizePathReference(input) && NormalizePath(normalized) == normalized);
+
+        // A parsed value serializes to JSON that parses back to it.
+        input = RandomString(rng, "{}[],:\"\\u0ae-.1 tfn", 16);
+        SciTokensJson value, reparsed;
+        if (SciTokensJson::parse(input, value)) {
+            std::string serialized;
+            value.serialize(serialized);
+            CHECK(SciTokensJson::parse(serialized, reparsed) && value.same(reparsed));
+        }
+    }
+    SciTokensJson value;
+    CHECK(SciTokensJson::parse("{\"scope\": [\"a\\u00e9\", 1e3, true, null]}", value));
+    CHECK(value.get("scope") && value.get("scope")->m_array.size() == 4);
+    CHECK(!SciTokensJson::parse("{\"a\": 1,}", value));
+}
+
+
+// The glob DFA, and in self-check builds the trie, agree with their reference
+// implementations on random rules and paths.
+static void TestPathMatchers()
+{
+    std::mt19937 rng(2);
+    for (int iteration = 0; iteration < 2000; iteration++) {
+        SciTokensGlobMatcher globs;
+        SciTokensPathTrie trie;
+        for (size_t idx = rng() % 5; idx > 0; idx--) {
+            SciTokensOp op = static_cast<SciTokensOp>(rng() % (SciTokensOp_Last + 1));
+            globs.add("/" + RandomString(rng, "/ab*?", 6), op);
+            trie.insert("/" + RandomString(rng, "/.ab", 6), op, rng() % 2);
+        }
+        globs.compile();
+        trie.finalize();
+        for (int lookup = 0; lookup < 8; lookup++) {
+            std::string path = "/" + RandomString(rng, "/.ab", 8);
+            CHECK(globs.match(path.c_str()) == globs.match_naive(path.c_str()));
+#ifdef SCITOKENS_SELFCHECK
+            int granted, denied, reference_granted, reference_denied;
+            SciTokensPrivs privs = trie.lookup(path.c_str(), granted, denied);
+            CHECK(trie.lookup_reference(path.c_str(), reference_granted, reference_denied) == privs &&
+                  granted == reference_granted && denied == reference_denied);
+#endif
+        }
+    }
+}
+
+
+// Configured denies withhold exactly the denied operations, whatever tokens
+// or groups grant, at any depth.
+static void TestDenies()
+{
+    QuietLog log;
+    SciTokensAuthorizer authz(log);
+    CHECK(Configure(authz, "[Issuer Archive]\nissuer = https://archive\nbase_path = /stash\n"
+                           "deny = storage.modify:/archive\n\n"
+                           "[Issuer Secure]\nissuer = https://secure\nbase_path = /stash\n"
+                           "deny = storage.read:/secure storage.modify:/user/*/priv?te\n\n"
+                           "[Group Secure]\nissuer = https://secure\ngroup = /staff\npath = /stash/secure/staff\n"
+                           "authz = read\n"));
+    const std::initializer_list<SciTokensOp> read_write = {SciTokensOp_Read, SciTokensOp_Create, SciTokensOp_Mkdir,
+        SciTokensOp_Update, SciTokensOp_Delete, SciTokensOp_Rename};
+
+    // storage.modify:/archive makes the archive read-only.
+    auto rules = Rules(authz, "https://archive", read_write, "/stash");
+    SciTokensPrivs privs = rules->apply(SciTokensOp_Read, "/stash/archive/f");
+    CHECK(OpPermitted(privs, SciTokensOp_Read));
+    CHECK(OpPermitted(privs, SciTokensOp_Readdir));
+    for (const auto op : {SciTokensOp_Create, SciTokensOp_Mkdir, SciTokensOp_Update, SciTokensOp_Delete,
+                          SciTokensOp_Rename}) {
+        CHECK(!OpPermitted(privs, op));
+    }
+    CHECK(OpPermitted(rules->apply(SciTokensOp_Update, "/stash/data/f"), SciTokensOp_Update));
+    // Also for globs.
+    rules = Rules(authz, "https://archive", read_write, "/stash/arch*");
+    privs = rules->apply(SciTokensOp_Read, "/stash/archive/f");
+    CHECK(OpPermitted(privs, SciTokensOp_Read) && !OpPermitted(privs, SciTokensOp_Update));
+
+    // A token's grant below storage.read:/secure does not override it; since
+    // an update's privileges include reads, updates are withheld as well.
+    rules = Rules(authz, "https://secure", {SciTokensOp_Read, SciTokensOp_Update}, "/stash/secure/sub");
+    CHECK(rules->apply(SciTokensOp_Read, "/stash/secure/sub/f") == SciTokensPriv_None);
+    rules = Rules(authz, "https://secure", {SciTokensOp_Read, SciTokensOp_Delete}, "/stash/secure/sub");
+    CHECK(rules->apply(SciTokensOp_Read, "/stash/secure/sub/f") == SciTokensPriv_Delete);
+    rules = Rules(authz, "https://secure", {SciTokensOp_Read}, "/stash/secure/s*");
+    CHECK(rules->apply(SciTokensOp_Read, "/stash/secure/sub/f") == SciTokensPriv_None);
+    // Nor does a group's.
+    rules = Rules(authz, "https://secure", {}, "/", {"/staff"});
+    CHECK(rules->apply(SciTokensOp_Read, "/stash/secure/staff/f") == SciTokensPriv_None);
+    rules = Rules(authz, "https://secure", {SciTokensOp_Read}, "/stash");
+    CHECK(OpPermitted(rules->apply(SciTokensOp_Read, "/stash/public/f"), SciTokensOp_Read));
+    CHECK(rules->apply(SciTokensOp_Read, "/stash/secure") == SciTokensPriv_None);
+
+    // Glob denies withhold their operations wherever the pattern matches,
+    // including over a token's own globs.
+    rules = Rules(authz, "https://secure", read_write, "/stash/user");
+    privs = rules->apply(SciTokensOp_Update, "/stash/user/bob/private/f");
+    CHECK(OpPermitted(privs, SciTokensOp_Read) && !OpPermitted(privs, SciTokensOp_Update) &&
+          !OpPermitted(privs, SciTokensOp_Delete));
+    CHECK(OpPermitted(rules->apply(SciTokensOp_Update, "/stash/user/bob/public/f"), SciTokensOp_Update));
+    CHECK(OpPermitted(rules->apply(SciTokensOp_Update, "/stash/user/bob/privates"), SciTokensOp_Update));
+    rules = Rules(authz, "https://secure", read_write, "/stash/user/*");
+    CHECK(!OpPermitted(rules->apply(SciTokensOp_Update, "/stash/user/bob/private"), SciTokensOp_Update));
+    CHECK(OpPermitted(rules->apply(SciTokensOp_Update, "/stash/user/bob/f"), SciTokensOp_Update));
+}
+
+
+// A validation engine whose validations of tokens containing "block" block
+// until released; it accepts every token as one of https://test granting read
+// on /test, and counts the validations started and running at once.
+class BlockingValidator : public SciTokensValidator
+{
+public:
+    virtual const char *Name() const {return "blocking";}
+    virtual bool Init(const SciTokensIssuerTable &, SciTokensLog &) {return true;}
+
+    virtual bool Validate(const char *authz, SciTokensInfo &info) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_running++;
+        m_started++;
+        m_max_running = std::max(m_max_running, m_running);
+        m_cond.notify_all();
+        if (strstr(authz, "block")) {
+            m_cond.wait(lock, [this]() {return m_released;});
+        }
+        m_running--;
+        info.m_issuer = "https://test";
+        info.m_expiry = m_expiry;
+        info.m_acls.emplace_back(SciTokensOp_Read, "/test");
+        return true;
+    }
+
+    // Wait until `count` validations have started.
+    void WaitStarted(unsigned count) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this, count]() {return m_started >= count;});
+    }
+
+    void Release() {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_released = true;
+        m_cond.notify_all();
+    }
+
+    unsigned Started() {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        return m_started;
+    }
+
+    unsigned MaxRunning() {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        return m_max_running;
+    }
+
+    // Lifetime of the validated tokens, in seconds.
+    uint64_t m_expiry{600};
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    bool m_released{false};
+    unsigned m_running{0};
+    unsigned m_started{0};
+    unsigned m_max_running{0};
+};
+
+
+// A token waiting for a validation slot is admitted when one is released
+// before its deadline; past it, the token leaves the queue holding no slot.
+static void TestFairQueue()
+{
+    SciTokensFairQueue queue(1, 20);
+    CHECK(queue.TryAcquire());
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(20);
+    CHECK(!queue.Acquire("https://a", deadline));
+    CHECK(std::chrono::steady_clock::now() >= deadline);
+    // The expired token left no turn behind; the slot is still held.
+    CHECK(!queue.TryAcquire());
+    queue.Release();
+    CHECK(queue.TryAcquire());
+
+    std::thread releaser([&queue]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        queue.Release();
+    });
+    CHECK(queue.Acquire("https://b", std::chrono::steady_clock::now() + std::chrono::seconds(10)));
+    releaser.join();
+    queue.Release();
+    CHECK(queue.TryAcquire());
+    queue.Release();
+
+    // A token that gets no slot by the deadline is not validated: Lookup()
+    // returns no rules, which the plugin treats as no token, and never
+    // validates outside the slots.
+    QuietLog log;
+    SciTokensAuthorizer authz(log);
+    BlockingValidator *validator = new BlockingValidator();
+    authz.SetValidator(std::unique_ptr<SciTokensValidator>(validator));
+    authz.SetValidationPool(1, 50);
+    CHECK(Configure(authz, "[Issuer Test]\nissuer = https://test\nbase_path = /test\n"));
+    std::shared_ptr<SciTokensRules> first;
+    std::thread holder([&authz, &first]() {
+        bool rebound;
+        first = authz.Lookup(nullptr, "Bearer block-1", rebound);
+    });
+    validator->WaitStarted(1);
+    bool rebound;
+    CHECK(!authz.Lookup(nullptr, "Bearer block-2", rebound));
+    CHECK(validator->Started() == 1);
+    validator->Release();
+    holder.join();
+    CHECK(first && OpPermitted(first->apply(SciTokensOp_Read, "/test/f"), SciTokensOp_Read));
+    CHECK(validator->MaxRunning() == 1);
+    // The expired token was not cached as invalid.
+    CHECK(authz.Lookup(nullptr, "Bearer block-2", rebound));
+}
+
+
+// A connection bound to a token's rules reuses them until it presents
+// another authorization; when its binding slot was taken by another
+// connection, the token cache still spares a validation.
+static void TestSessionBinding()
+{
+    QuietLog log;
+    SciTokensAuthorizer authz(log);
+    BlockingValidator *validator = new BlockingValidator();
+    authz.SetValidator(std::unique_ptr<SciTokensValidator>(validator));
+    CHECK(Configure(authz, "[Issuer Test]\nissuer = https://test\nbase_path = /test\n"));
+    // Opaque session keys: 0x10 and 0x410 share a binding slot.
+    const void *session = reinterpret_cast<const void *>(0x10);
+    const void *colliding = reinterpret_cast<const void *>(0x410);
+    bool rebound;
+
+    auto first = authz.Lookup(session, "Bearer a", rebound);
+    CHECK(first && rebound && validator->Started() == 1);
+    CHECK(authz.Lookup(session, "Bearer a", rebound) == first && !rebound);
+    // Another authorization on the same connection misses the binding.
+    auto second = authz.Lookup(session, "Bearer b", rebound);
+    CHECK(second && second != first && rebound && validator->Started() == 2);
+    CHECK(authz.Lookup(session, "Bearer b", rebound) == second && !rebound);
+    // Another connection presenting the first token hits the token cache.
+    CHECK(authz.Lookup(colliding, "Bearer a", rebound) == first && rebound && validator->Started() == 2);
+    // It took the slot of `session`, which is rebound from the cache.
+    CHECK(authz.Lookup(session, "Bearer b", rebound) == second && rebound && validator->Started() == 2);
+    CHECK(authz.Lookup(session, "Bearer b", rebound) == second && !rebound);
+
+    SciTokensSessionTable sessions;
+    sessions.put(session, "Bearer a", 8, 0, first);
+    CHECK(sessions.get(session, "Bearer a", 8, 0) == first);
+    CHECK(!sessions.get(session, "Bearer a", 8, 1));
+    CHECK(!sessions.get(colliding, "Bearer a", 8, 0));
+    sessions.put(colliding, "Bearer a", 8, 0, first);
+    CHECK(!sessions.get(session, "Bearer a", 8, 0));
+}
+
+
+// Idle pool threads steal the tasks queued for busy ones; a task no thread
+// has started by its deadline is returned unvalidated rather than validated
+// by the submitting thread.
+static void TestValidationPool()
+{
+    BlockingValidator validator;
+    RecordingLog log;
+    {
+        SciTokensValidationPool pool(validator, 2, 1000);
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        bool blocked_valid = false, expired = false;
+        std::thread blocked([&]() {
+            SciTokensInfo info;
+            bool blocked_expired;
+            blocked_valid = pool.Validate("Bearer block", info, deadline, blocked_expired);
+        });
+        validator.WaitStarted(1);
+        // Submissions alternate between the two threads' deques; those
+        // queued for the blocked thread can only be served by stealing.
+        for (int idx = 0; idx < 4; idx++) {
+            SciTokensInfo info;
+            CHECK(pool.Validate("Bearer quick", info, deadline, expired) && !expired);
+            CHECK(info.m_issuer == "https://test");
+        }
+        validator.Release();
+        blocked.join();
+        CHECK(blocked_valid);
+        pool.Report(60, log);
+        CHECK(log.Contains("5 tokens validated by 2 threads (") && !log.Contains("(0 stolen)") &&
+              !log.Contains("(1 stolen)"));
+    }
+
+    BlockingValidator slow;
+    SciTokensValidationPool pool(slow, 1, 1000);
+    std::thread blocked([&pool]() {
+        SciTokensInfo info;
+        bool expired;
+        pool.Validate("Bearer block", info, std::chrono::steady_clock::now() + std::chrono::seconds(10), expired);
+    });
+    slow.WaitStarted(1);
+    SciTokensInfo info;
+    bool expired = false;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(30);
+    CHECK(!pool.Validate("Bearer quick", info, deadline, expired) && expired);
+    CHECK(std::chrono::steady_clock::now() >= deadline);
+    CHECK(slow.Started() == 1 && slow.MaxRunning() == 1);
+    slow.Release();
+    blocked.join();
+    // The expired task is skipped rather than validated late.
+    CHECK(pool.Validate("Bearer quick", info, std::chrono::steady_clock::now() + std::chrono::seconds(10), expired));
+    CHECK(slow.Started() == 2);
+    pool.Report(60, log);
+    CHECK(log.Contains("2 tokens validated by 1 threads (0 stolen), 1 not validated"));
+}
+
+
+// Only issuers with map_groups export the token's groups as the entity's
+// group list, which the chained authorizer grants by.
+static void TestMapGroups()
+{
+    QuietLog log;
+    SciTokensAuthorizer authz(log);
+    CHECK(Configure(authz, "[Issuer Mapped]\nissuer = https://mapped\nbase_path = /mapped\nmap_groups = true\n\n"
+                           "[Issuer Plain]\nissuer = https://plain\nbase_path = /plain\n"));
+    auto rules = Rules(authz, "https://mapped", {}, "/", {"/cms", "/cms/production"});
+    CHECK(rules->get_mapped_groups() && !strcmp(rules->get_mapped_groups(), "/cms /cms/production"));
+    CHECK(!Rules(authz, "https://mapped", {}, "/")->get_mapped_groups());
+    rules = Rules(authz, "https://plain", {}, "/", {"/cms"});
+    CHECK(!rules->get_mapped_groups());
+    bool exported = false;
+    for (const auto &attr : rules->get_attributes()) {
+        exported = exported || (attr.first == "scitokens.groups" && attr.second == "/cms");
+    }
+    CHECK(exported);
+}
+
+
+// A chained authorizer granting fixed privileges, counting its decisions.
+class CountingChain : public SciTokensChain
+{
+public:
+    CountingChain(SciTokensPrivs privs, const std::string &key="") : m_privs(privs), m_key(key) {}
+
+    virtual SciTokensPrivs Access() {
+        m_calls++;
+        return m_privs;
+    }
+
+    virtual std::string Key() const {return m_key;}
+
+    SciTokensPrivs m_privs;
+    std::string m_key;
+    unsigned m_calls{0};
+};
+
+
+// Under the base path of an authoritative issuer, requests without a token,
+// with an invalid token or with a token granting nothing are denied without
+// consulting the chained authorizer; elsewhere the chain decides them.
+static void TestAuthoritative()
+{
+    QuietLog log;
+    SciTokensAuthorizer authz(log);
+    CHECK(Configure(authz, "[Issuer Owner]\nissuer = https://owner\nbase_path = /owned\nauthoritative = true\n\n"
+                           "[Issuer Other]\nissuer = https://other\nbase_path = /shared\n"));
+    CHECK(authz.Authoritative("/owned") && authz.Authoritative("/owned/f"));
+    CHECK(!authz.Authoritative("/ownedx") && !authz.Authoritative("/shared/f") && !authz.Authoritative("/"));
+
+    CountingChain chain(SciTokensPriv_Read);
+    // No token.
+    CHECK(authz.Chain(chain, "/owned/f") == SciTokensPriv_None && chain.m_calls == 0);
+    CHECK(authz.Chain(chain, "/shared/f") == SciTokensPriv_Read && chain.m_calls == 1);
+    // An invalid token has no rules, so it is decided as no token.
+    bool rebound;
+    CHECK(!authz.Lookup(nullptr, "Bearer invalid", rebound));
+    // A token granting nothing on the path.
+    auto rules = Rules(authz, "https://owner", {SciTokensOp_Read}, "/owned/public");
+    CHECK(rules->apply(SciTokensOp_Read, "/owned/private/f") == SciTokensPriv_None);
+    CHECK(authz.Chain(chain, "/owned/private/f", rules.get()) == SciTokensPriv_None && chain.m_calls == 1);
+    CHECK(authz.Chain(chain, "/shared/f", rules.get()) == SciTokensPriv_Read && chain.m_calls == 2);
+}
+
+
+// Decisions of the chained authorizer are cached per token and per request
+// key (the client's identity, operation and path), up to the configured
+// number, and die with the token's rules when it expires.
+static void TestChainCache()
+{
+    QuietLog log;
+    SciTokensAuthorizer authz(log);
+    BlockingValidator *validator = new BlockingValidator();
+    validator->m_expiry = 0;
+    authz.SetValidator(std::unique_ptr<SciTokensValidator>(validator));
+    authz.SetChainCache(3);
+    CHECK(Configure(authz, "[Issuer Test]\nissuer = https://test\nbase_path = /test\n"));
+    const int read = static_cast<int>(SciTokensOp_Read);
+    const std::string alice = SciTokensChain::MakeKey("gsi", {"alice", "host", nullptr, nullptr, "/cms"}, read, "/f");
+    const std::string bob = SciTokensChain::MakeKey("gsi", {"bob", "host", nullptr, nullptr, "/cms"}, read, "/f");
+    const std::string atlas = SciTokensChain::MakeKey("gsi", {"alice", "host", nullptr, nullptr, "/atlas"}, read,
+                                                      "/f");
+    CHECK(alice != bob && alice != atlas && bob != atlas);
+    CHECK(alice != SciTokensChain::MakeKey("gsi", {"alice", "host", nullptr, nullptr, "/cms"}, read, "/g"));
+    CHECK(alice != SciTokensChain::MakeKey("gsi", {"alice", "host", nullptr, nullptr, "/cms"},
+                                           static_cast<int>(SciTokensOp_Update), "/f"));
+
+    bool rebound;
+    auto rules = authz.Lookup(nullptr, "Bearer a", rebound);
+    CHECK(rules);
+    if (!rules) {return;}
+    CountingChain chain(SciTokensPriv_Read, alice);
+    CHECK(authz.Chain(chain, "/f", rules.get()) == SciTokensPriv_Read && chain.m_calls == 1);
+    CHECK(authz.Chain(chain, "/f", rules.get()) == SciTokensPriv_Read && chain.m_calls == 1);
+    // Another entity name or group list is decided anew.
+    for (const auto &key : {bob, atlas}) {
+        CountingChain other(SciTokensPriv_None, key);
+        CHECK(authz.Chain(other, "/f", rules.get()) == SciTokensPriv_None && other.m_calls == 1);
+        CHECK(authz.Chain(other, "/f", rules.get()) == SciTokensPriv_None && other.m_calls == 1);
+    }
+    CHECK(authz.Chain(chain, "/f", rules.get()) == SciTokensPriv_Read && chain.m_calls == 1);
+    // Without a token there is nothing to cache in.
+    CHECK(authz.Chain(chain, "/f") == SciTokensPriv_Read && chain.m_calls == 2);
+    // Nor are decisions shared with another token.
+    auto other_rules = authz.Lookup(nullptr, "Bearer b", rebound);
+    CHECK(other_rules && authz.Chain(chain, "/f", other_rules.get()) == SciTokensPriv_Read && chain.m_calls == 3);
+    // A full cache starts over.
+    CountingChain fourth(SciTokensPriv_None, alice + "/4");
+    CHECK(authz.Chain(fourth, "/f", rules.get()) == SciTokensPriv_None && fourth.m_calls == 1);
+    CHECK(authz.Chain(chain, "/f", rules.get()) == SciTokensPriv_Read && chain.m_calls == 4);
+
+    // Once the token expires, it is validated again into rules that have
+    // not cached any decision.
+    while (!rules->expired()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    auto renewed = authz.Lookup(nullptr, "Bearer a", rebound);
+    CHECK(renewed && renewed != rules && validator->Started() == 3);
+    CHECK(renewed && authz.Chain(chain, "/f", renewed.get()) == SciTokensPriv_Read && chain.m_calls == 5);
+}
+
+
+// The native engine accepts correctly signed tokens of each algorithm and
+// rejects tampered ones; the paths of `path` and `scope` claims never escape
+// the base path.
+static void TestNativeValidator()
+{
+    const TestIssuers &issuers = Issuers();
+    CHECK(issuers.m_ready);
+    QuietLog log;
+    SciTokensAuthorizer authz(log);
+    CHECK(Configure(authz, issuers.Config()));
+    SciTokensNativeValidator native;
+    CHECK(native.Init(authz.Issuers(), log));
+    for (EVP_PKEY *key : {issuers.m_rsa, issuers.m_ec, issuers.m_ed}) {
+        SciTokensInfo info;
+        std::string token = issuers.Token(key, "\"sub\":\"alice\",\"authz\":\"read\",\"path\":\"/data\"");
+        CHECK(native.Validate(token.c_str(), info));
+        CHECK(info.m_subject == "alice" && info.m_acls.size() == 1 && info.m_acls[0].second == "/stash/data");
+        // A modified claim set invalidates the signature.
+        std::string tampered = token;
+        size_t dot = tampered.find('.');
+        tampered[dot + 2] = tampered[dot + 2] == 'A' ? 'B' : 'A';
+        CHECK(!native.Validate(tampered.c_str(), info));
+        // So does a key of another issuer.
+        std::string forged = issuers.Token(key == issuers.m_ec ? issuers.m_rsa : issuers.m_ec, "");
+        forged = forged.substr(0, forged.find('.')) + token.substr(token.find('.'));
+        CHECK(!native.Validate(forged.c_str(), info));
+    }
+
+    for (const char *path : {"/../etc", "/data/../../etc", "/./../../etc/"}) {
+        SciTokensInfo info;
+        std::string token = issuers.Token(issuers.m_ec, std::string("\"authz\":\"read\",\"path\":\"") + path + "\"");
+        CHECK(native.Validate(token.c_str(), info));
+        auto rules = authz.Compile(info);
+        CHECK(rules->apply(SciTokensOp_Read, "/etc/passwd") == SciTokensPriv_None);
+        CHECK(OpPermitted(rules->apply(SciTokensOp_Read, "/stash/etc/passwd"), SciTokensOp_Read));
+    }
+    // Nor do the paths of scopes.
+    for (const char *scope : {"storage.read:/../etc", "storage.read:/data/../../etc storage.modify:/../../etc"}) {
+        SciTokensInfo info;
+        std::string token = issuers.Token(issuers.m_ed, std::string("\"scope\":\"") + scope + "\"");
+        CHECK(native.Validate(token.c_str(), info));
+        auto rules = authz.Compile(info);
+        CHECK(rules->apply(SciTokensOp_Read, "/etc/passwd") == SciTokensPriv_None);
+        CHECK(OpPermitted(rules->apply(SciTokensOp_Read, "/stash/etc/passwd"), SciTokensOp_Read));
+    }
+}
+
+
+// Engines are selected by name; the worker engine validates in its worker
+// processes as the native engine does in-process, and records its latency.
+static void TestEngines()
+{
+    for (const char *name : {"native", "stub", "worker"}) {
+        auto validator = SciTokensValidator::Make(name, SCITOKENS_WORKER_PROGRAM, "", 1);
+        CHECK(validator && !strcmp(validator->Name(), name));
+    }
+    CHECK(!SciTokensValidator::Make("python", SCITOKENS_WORKER_PROGRAM, "", 1));
+    CHECK(!SciTokensValidator::Make("", SCITOKENS_WORKER_PROGRAM, "", 1));
+
+    const TestIssuers &issuers = Issuers();
+    CHECK(issuers.m_ready);
+    char config[] = "/tmp/scitokens-core-test.XXXXXX";
+    int fd = mkstemp(config);
+    CHECK(fd >= 0);
+    if (fd < 0) {return;}
+    const std::string contents = issuers.Config();
+    CHECK(write(fd, contents.data(), contents.size()) == static_cast<ssize_t>(contents.size()));
+    close(fd);
+
+    RecordingLog log;
+    SciTokensAuthorizer authz(log);
+    authz.SetValidator(SciTokensValidator::Make("worker", SCITOKENS_WORKER_PROGRAM, config, 2));
+    CHECK(authz.Config(config));
+    CHECK(authz.Validator() && !strcmp(authz.Validator()->Name(), "worker"));
+    CHECK(log.Contains("Started 2 token validation workers"));
+    bool rebound;
+    auto rules = authz.Lookup(nullptr, issuers.Token(issuers.m_rsa, "\"scope\":\"storage.read:/data\"").c_str(),
+                              rebound);
+    CHECK(rules && OpPermitted(rules->apply(SciTokensOp_Read, "/stash/data/f"), SciTokensOp_Read));
+    CHECK(rules && rules->apply(SciTokensOp_Read, "/stash/other") == SciTokensPriv_None);
+
+    SciTokensWorkerValidator worker(SCITOKENS_WORKER_PROGRAM, config, 1);
+    SciTokensNativeValidator native;
+    CHECK(worker.Init(authz.Issuers(), log) && native.Init(authz.Issuers(), log));
+    for (EVP_PKEY *key : {issuers.m_rsa, issuers.m_ec, issuers.m_ed}) {
+        std::string token = issuers.Token(key, "\"sub\":\"alice\",\"wlcg.groups\":[\"/cms\"],"
+                                               "\"scope\":\"storage.read:/data storage.create:/out\"");
+        SciTokensInfo from_worker, from_native;
+        CHECK(worker.TimedValidate(token.c_str(), from_worker) && native.Validate(token.c_str(), from_native));
+        CHECK(from_worker.m_issuer == from_native.m_issuer && from_worker.m_subject == "alice" &&
+              from_worker.m_subject == from_native.m_subject && from_worker.m_username == from_native.m_username &&
+              from_worker.m_groups == from_native.m_groups && from_worker.m_acls == from_native.m_acls &&
+              from_worker.m_expiry <= from_native.m_expiry && from_worker.m_expiry + 2 >= from_native.m_expiry);
+        CHECK(!from_worker.m_acls.empty());
+    }
+    SciTokensInfo info;
+    std::string tampered = issuers.Token(issuers.m_ec, "");
+    size_t dot = tampered.find('.');
+    tampered[dot + 2] = tampered[dot + 2] == 'A' ? 'B' : 'A';
+    CHECK(!worker.TimedValidate(tampered.c_str(), info));
+    worker.Stats().report(worker.Name(), 60, log);
+    CHECK(log.Contains("Validation engine worker: 4 tokens (1 rejected) in 60s"));
+
+    // A worker that cannot be started makes the engine unusable.
+    SciTokensWorkerValidator missing("/nonexistent/xrootd-scitokens-worker", config, 1);
+    QuietLog quiet;
+    CHECK(!missing.Init(authz.Issuers(), quiet));
+    unlink(config);
+}
+
+
+// Validates every token into a fixed outcome.
+class FixedValidator : public SciTokensValidator
+{
+public:
+    FixedValidator(bool valid, const SciTokensInfo &info) : m_valid(valid), m_info(info) {}
+
+    virtual const char *Name() const {return "fixed";}
+    virtual bool Init(const SciTokensIssuerTable &, SciTokensLog &) {return true;}
+
+    virtual bool Validate(const char *, SciTokensInfo &info) {
+        info = m_info;
+        return m_valid;
+    }
+
+private:
+    bool m_valid;
+    SciTokensInfo m_info;
+};
+
+
+// The shadow engine counts a mismatch exactly when its result differs from
+// the primary engine's in validity, expiry beyond the tolerance, username or
+// the privileges of the compiled rules; it compares the sampled fraction.
+static void TestShadow()
+{
+    QuietLog quiet;
+    SciTokensAuthorizer authz(quiet);
+    CHECK(Configure(authz, "[Issuer Test]\nissuer = https://test\nbase_path = /test\n"));
+    SciTokensInfo primary_info;
+    primary_info.m_issuer = "https://test";
+    primary_info.m_username = "alice";
+    primary_info.m_expiry = 600;
+    primary_info.m_acls = {{SciTokensOp_Read, "/test/data"}, {SciTokensOp_Create, "/test/out"}};
+    auto primary = authz.Compile(primary_info);
+
+    // Each shadow result, and whether it mismatches the primary's.
+    std::vector<std::pair<SciTokensInfo, bool>> cases;
+    cases.emplace_back(primary_info, false);
+    SciTokensInfo info = primary_info;
+    // The same privileges, granted in another order.
+    info.m_acls = {{SciTokensOp_Create, "/test/out"}, {SciTokensOp_Read, "/test/data/"}};
+    info.m_expiry = 601;
+    cases.emplace_back(info, false);
+    info = primary_info;
+    info.m_acls[1].first = SciTokensOp_Update;
+    cases.emplace_back(info, true);
+    info = primary_info;
+    info.m_acls[0].second = "/test";
+    cases.emplace_back(info, true);
+    info = primary_info;
+    info.m_expiry = 3600;
+    cases.emplace_back(info, true);
+    info = primary_info;
+    info.m_username = "bob";
+    cases.emplace_back(info, true);
+    for (const auto &shadow_case : cases) {
+        RecordingLog log;
+        SciTokensShadow shadow(authz, std::unique_ptr<SciTokensValidator>(new FixedValidator(true, shadow_case.first)),
+                               1, log);
+        CHECK(shadow.Init(authz.Issuers()));
+        shadow.Submit("Bearer a", primary);
+        shadow.Drain();
+        shadow.Report(60);
+        CHECK(log.Contains(std::string("1 tokens compared, ") + (shadow_case.second ? "1" : "0") + " mismatched"));
+    }
+
+    // Disagreeing on validity, either way, is a mismatch.
+    RecordingLog log;
+    SciTokensShadow rejecting(authz, std::unique_ptr<SciTokensValidator>(new FixedValidator(false, primary_info)),
+                              1, log);
+    CHECK(rejecting.Init(authz.Issuers()));
+    rejecting.Submit("Bearer a", primary);
+    rejecting.Submit("Bearer b", nullptr);
+    rejecting.Drain();
+    rejecting.Report(60);
+    CHECK(log.Contains("2 tokens compared, 1 mismatched"));
+
+    RecordingLog sampled_log;
+    SciTokensShadow sampled(authz, std::unique_ptr<SciTokensValidator>(new FixedValidator(true, primary_info)),
+                            0.25, sampled_log);
+    CHECK(sampled.Init(authz.Issuers()));
+    for (int idx = 0; idx < 8; idx++) {
+        sampled.Submit("Bearer a", primary);
+    }
+    sampled.Drain();
+    sampled.Report(60);
+    CHECK(sampled_log.Contains("2 tokens compared, 0 mismatched"));
+}
+
+
+// Scopes parsed once are reused for later tokens with the same scope, but
+// only under the same base path; malformed scopes stay rejected.
+static void TestScopeCache()
+{
+    QuietLog log;
+    SciTokensAuthorizer authz(log);
+    CHECK(Configure(authz, "[Issuer One]\nissuer = https://one\nbase_path = /one\n\n"
+                           "[Issuer Two]\nissuer = https://two\nbase_path = /two\n"));
+    SciTokensStubValidator stub;
+    CHECK(stub.Init(authz.Issuers(), log));
+    EVP_PKEY *key = GenerateKey(EVP_PKEY_EC);
+    const std::string exp = std::to_string(time(nullptr) + 600);
+    for (int round = 0; round < 2; round++) {
+        for (const char *issuer : {"one", "two"}) {
+            SciTokensInfo info;
+            std::string token = SignToken(key, std::string("{\"iss\":\"https://") + issuer + "\",\"exp\":" + exp +
+                                               ",\"scope\":\"storage.read:/data storage.create:/out\"}");
+            CHECK(stub.Validate(token.c_str(), info));
+            const std::string base = std::string("/") + issuer;
+            CHECK(info.m_acls.size() == 3 && info.m_acls[0] == std::make_pair(SciTokensOp_Read, base + "/data") &&
+                  info.m_acls[1] == std::make_pair(SciTokensOp_Create, base + "/out") &&
+                  info.m_acls[2] == std::make_pair(SciTokensOp_Mkdir, base + "/out"));
+        }
+        SciTokensInfo info;
+        CHECK(!stub.Validate(SignToken(key, "{\"iss\":\"https://one\",\"exp\":" + exp +
+                                            ",\"scope\":\"storage.read:data\"}").c_str(), info));
+    }
+    EVP_PKEY_free(key);
+}
+
+
+// An issuer whose public_key_file cannot be loaded is kept, for the python
+// engine, but the core's engines reject its tokens.
+static void TestUnloadableKey()
+{
+    QuietLog log;
+    SciTokensAuthorizer authz(log);
+    CHECK(Configure(authz, "[Issuer Broken]\nissuer = https://broken\nbase_path = /broken\n"
+                           "public_key_file = /nonexistent/key.pem\n"));
+    const SciTokensIssuer *issuer = authz.Issuers().find("https://broken");
+    CHECK(issuer && !issuer->m_public_key && !issuer->m_key_error.empty());
+
+    EVP_PKEY *key = GenerateKey(EVP_PKEY_EC);
+    std::string token = SignToken(key, "{\"iss\":\"https://broken\",\"exp\":" + std::to_string(time(nullptr) + 600) +
+                                       ",\"scope\":\"storage.read:/\"}");
+    EVP_PKEY_free(key);
+    SciTokensNativeValidator native;
+    SciTokensStubValidator stub;
+    for (SciTokensValidator *validator : std::initializer_list<SciTokensValidator *>{&native, &stub}) {
+        SciTokensInfo info;
+        CHECK(validator->Init(authz.Issuers(), log));
+        CHECK(!validator->Validate(token.c_str(), info));
+    }
+}
+
+
+int main()
+{
+    static const struct {
+        const char *m_name;
+        void (*m_test)();
+    } tests[] = {
+        {"op permitted", TestOpPermitted},
+        {"glob matcher", TestGlobMatcher},
+        {"parsers", TestParsers},
+        {"path matchers", TestPathMatchers},
+        {"denies", TestDenies},
+        {"session binding", TestSessionBinding},
+        {"fair queue", TestFairQueue},
+        {"validation pool", TestValidationPool},
+        {"map groups", TestMapGroups},
+        {"authoritative", TestAuthoritative},
+        {"chain cache", TestChainCache},
+        {"native validator", TestNativeValidator},
+        {"engines", TestEngines},
+        {"shadow", TestShadow},
+        {"scope cache", TestScopeCache},
+        {"unloadable key", TestUnloadableKey},
+    };
+    for (const auto &test : tests) {
+        int failures = g_failures;
+        test.m_test();
+        printf("%-24s %s\n", test.m_name, g_failures == failures ? "ok" : "FAILED");
+    }
+    return g_failures ? 1 : 0;
+}
@@ -0,0 +1,16 @@
+// libFuzzer target for Base64UrlDecode(), built when SCITOKENS_FUZZERS is ON:
+//
+//   scitokens-fuzz-base64url [corpus directory]
+//
+// Aborts when the decoder disagrees with Base64UrlDecodeReference().
+
+#include "scitokens_parse.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    const std::string input(reinterpret_cast<const char *>(data), size);
+    std::string output, reference;
+    bool valid = Base64UrlDecode(input.data(), input.size(), output);
+    if (Base64UrlDecodeReference(input, reference) != valid || (valid && output != reference)) {abort();}
+    return 0;
+}
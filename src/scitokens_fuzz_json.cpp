@@ -0,0 +1,20 @@
+// libFuzzer target for SciTokensJson::parse(), built when SCITOKENS_FUZZERS is
+// ON:
+//
+//   scitokens-fuzz-json [corpus directory]
+//
+// Aborts unless a parsed value serializes to JSON that parses back to the
+// same value.
+
+#include "scitokens_parse.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    const std::string input(reinterpret_cast<const char *>(data), size);
+    SciTokensJson value, reparsed;
+    if (!SciTokensJson::parse(input, value)) {return 0;}
+    std::string serialized;
+    value.serialize(serialized);
+    if (!SciTokensJson::parse(serialized, reparsed) || !value.same(reparsed)) {abort();}
+    return 0;
+}
@@ -0,0 +1,17 @@
+// libFuzzer target for NormalizePath(), built when SCITOKENS_FUZZERS is ON:
+//
+//   scitokens-fuzz-path [corpus directory]
+//
+// Aborts when the normalized path differs from NormalizePathReference()'s or
+// is not itself normalized.
+
+#include "scitokens_parse.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    // Paths are C strings wherever they are normalized.
+    const std::string input(reinterpret_cast<const char *>(data), strnlen(reinterpret_cast<const char *>(data), size));
+    std::string normalized = NormalizePath(input);
+    if (normalized != NormalizePathReference(input) || NormalizePath(normalized) != normalized) {abort();}
+    return 0;
+}
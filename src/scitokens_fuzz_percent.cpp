@@ -0,0 +1,16 @@
+// libFuzzer target for PercentDecode(), built when SCITOKENS_FUZZERS is ON:
+//
+//   scitokens-fuzz-percent [corpus directory]
+//
+// Aborts when the decoder disagrees with PercentDecodeReference().
+
+#include "scitokens_parse.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    const std::string input(reinterpret_cast<const char *>(data), size);
+    std::string output, reference;
+    bool valid = PercentDecode(input.data(), input.size(), output);
+    if (PercentDecodeReference(input, reference) != valid || (valid && output != reference)) {abort();}
+    return 0;
+}
@@ -0,0 +1,72 @@
+// libFuzzer target for the path trie and glob matcher, built when
+// SCITOKENS_FUZZERS is ON (which implies SCITOKENS_SELFCHECK):
+//
+//   scitokens-fuzz-rules [corpus directory]
+//
+// The input is a list of lines: each but the last is a rule, whose first byte
+// selects the operation (and, with its high bit set, a denial) and whose
+// remainder is the path or glob pattern; the last line is the path looked up.
+// As in SciTokensRules, glob rules go to a grant or deny glob matcher and the
+// others to the path trie.  Aborts when SciTokensPathTrie::lookup() disagrees
+// with lookup_reference(), or a glob DFA with match_naive() or with the DFA
+// compiled from the same patterns in the reverse order.
+
+#include "scitokens_parse.h"
+
+#ifndef SCITOKENS_SELFCHECK
+#error "scitokens_fuzz_rules.cpp requires SCITOKENS_SELFCHECK"
+#endif
+
+// Bounds the DFA's construction; real tokens carry a handful of globs.
+static const size_t g_max_rules = 32;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    std::vector<std::string> lines(1);
+    for (size_t idx = 0; idx < size; idx++) {
+        // Paths are C strings; treat a NUL as the end of a line.
+        if (data[idx] == '\n' || data[idx] == '\0') {
+            lines.emplace_back();
+        } else {
+            lines.back().push_back(static_cast<char>(data[idx]));
+        }
+    }
+    if (lines.size() - 1 > g_max_rules) {return 0;}
+    const std::string &path = lines.back();
+
+    std::vector<std::pair<SciTokensOp, std::string>> globs[2];
+    SciTokensPathTrie trie;
+    for (size_t idx = 0; idx + 1 < lines.size(); idx++) {
+        const std::string &line = lines[idx];
+        if (line.empty()) {continue;}
+        unsigned char selector = line[0];
+        SciTokensOp op = static_cast<SciTokensOp>((selector & 0x7f) % (SciTokensOp_Last + 1));
+        bool deny = selector & 0x80;
+        std::string rule = line.substr(1);
+        if (SciTokensGlobMatcher::is_glob(rule)) {
+            globs[deny].emplace_back(op, rule);
+        } else {
+            trie.insert(rule, op, deny);
+        }
+    }
+    trie.finalize();
+    int granted, denied, reference_granted, reference_denied;
+    SciTokensPrivs privs = trie.lookup(path.c_str(), granted, denied);
+    if (trie.lookup_reference(path.c_str(), reference_granted, reference_denied) != privs ||
+        granted != reference_granted || denied != reference_denied) {
+        abort();
+    }
+
+    for (const auto &patterns : globs) {
+        SciTokensGlobMatcher forward, backward;
+        for (size_t idx = 0; idx < patterns.size(); idx++) {
+            forward.add(patterns[idx].second, patterns[idx].first);
+            backward.add(patterns[patterns.size() - 1 - idx].second, patterns[patterns.size() - 1 - idx].first);
+        }
+        forward.compile();
+        backward.compile();
+        int ops = forward.match(path.c_str());
+        if (ops != forward.match_naive(path.c_str()) || ops != backward.match(path.c_str())) {abort();}
+    }
+    return 0;
+}
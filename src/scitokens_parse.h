@@ -0,0 +1,302 @@
+// Parsers of the untrusted input of a request: the percent-encoded
+// authorization, the base64url segments and JSON of the token, and its
+// paths.  Internal to the authorization core; shared with its unit tests and
+// fuzz targets, which compare each parser with its reference implementation.
+
+#ifndef SCITOKENS_PARSE_H
+#define SCITOKENS_PARSE_H
+
+#include "scitokens_core.h"
+
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+
+// Normalize an absolute path: collapse repeated slashes and resolve "." and
+// ".." components (never above the root).
+std::string NormalizePath(const std::string &path);
+
+// Decode a percent-encoded string; returns false on a malformed escape.
+bool PercentDecode(const char *input, size_t len, std::string &output);
+
+// Decode unpadded (or padded) base64url; returns false on invalid input.
+bool Base64UrlDecode(const char *input, size_t len, std::string &output);
+
+// Slow, obviously correct implementations of the above; the self-checks,
+// tests and fuzzers require each parser to agree with its reference.
+std::string NormalizePathReference(const std::string &path);
+bool PercentDecodeReference(const std::string &input, std::string &output);
+bool Base64UrlDecodeReference(std::string input, std::string &output);
+
+
+// A parsed JSON value; sufficient for the header and claims of a JWT.
+struct SciTokensJson
+{
+    enum Type {Null, Bool, Number, String, Array, Object};
+
+    // Returns the member `key` of an object, or nullptr.
+    const SciTokensJson *get(const char *key) const {
+        if (m_type != Object) {return nullptr;}
+        for (const auto &member : m_object) {
+            if (member.first == key) {return &member.second;}
+        }
+        return nullptr;
+    }
+
+    static bool parse(const std::string &input, SciTokensJson &value) {
+        const char *ptr = input.data(), *end = input.data() + input.size();
+        if (!parse_value(ptr, end, value, 0)) {return false;}
+        skip_space(ptr, end);
+        if (ptr != end) {return false;}
+#ifdef SCITOKENS_SELFCHECK
+        // Property: serializing the parsed value and parsing it again yields
+        // the same value.
+        std::string serialized;
+        value.serialize(serialized);
+        SciTokensJson reparsed;
+        ptr = serialized.data();
+        end = serialized.data() + serialized.size();
+        SciTokensSelfCheck("SciTokensJson::parse", input, parse_value(ptr, end, reparsed, 0) && ptr == end &&
+                                                           value.same(reparsed));
+#endif
+        return true;
+    }
+
+    // Serialize the value as JSON that parses back to the same value; used by
+    // the self-checks, tests and fuzzers.
+    void serialize(std::string &out) const {
+        switch (m_type) {
+        case Null: out += "null"; break;
+        case Bool: out += m_bool ? "true" : "false"; break;
+        case Number: {
+            char buf[32];
+            if (std::isinf(m_number)) {
+                out += (m_number < 0) ? "-1e999" : "1e999";
+            } else {
+                snprintf(buf, sizeof(buf), "%.17g", m_number);
+                out += buf;
+            }
+            break;
+        }
+        case String: serialize_string(m_string, out); break;
+        case Array:
+            out += '[';
+            for (size_t idx = 0; idx < m_array.size(); idx++) {
+                if (idx) {out += ',';}
+                m_array[idx].serialize(out);
+            }
+            out += ']';
+            break;
+        case Object:
+            out += '{';
+            for (size_t idx = 0; idx < m_object.size(); idx++) {
+                if (idx) {out += ',';}
+                serialize_string(m_object[idx].first, out);
+                out += ':';
+                m_object[idx].second.serialize(out);
+            }
+            out += '}';
+            break;
+        }
+    }
+
+    bool same(const SciTokensJson &other) const {
+        if (m_type != other.m_type || m_bool != other.m_bool || m_string != other.m_string ||
+            m_array.size() != other.m_array.size() || m_object.size() != other.m_object.size()) {
+            return false;
+        }
+        if (m_type == Number && m_number != other.m_number) {return false;}
+        for (size_t idx = 0; idx < m_array.size(); idx++) {
+            if (!m_array[idx].same(other.m_array[idx])) {return false;}
+        }
+        for (size_t idx = 0; idx < m_object.size(); idx++) {
+            if (m_object[idx].first != other.m_object[idx].first || !m_object[idx].second.same(other.m_object[idx].second)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    Type m_type{Null};
+    bool m_bool{false};
+    double m_number{0};
+    std::string m_string;
+    std::vector<SciTokensJson> m_array;
+    std::vector<std::pair<std::string, SciTokensJson>> m_object;
+
+private:
+    static constexpr int m_max_depth = 32;
+
+    static void serialize_string(const std::string &value, std::string &out) {
+        out += '"';
+        for (unsigned char c : value) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if (c < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                out += buf;
+            } else {
+                out += c;
+            }
+        }
+        out += '"';
+    }
+
+    static void skip_space(const char *&ptr, const char *end) {
+        while (ptr < end && (*ptr == ' ' || *ptr == '\t' || *ptr == '\n' || *ptr == '\r')) {ptr++;}
+    }
+
+    static bool parse_literal(const char *&ptr, const char *end, const char *literal) {
+        size_t len = strlen(literal);
+        if (static_cast<size_t>(end - ptr) < len || memcmp(ptr, literal, len)) {return false;}
+        ptr += len;
+        return true;
+    }
+
+    static bool parse_value(const char *&ptr, const char *end, SciTokensJson &value, int depth) {
+        if (depth > m_max_depth) {return false;}
+        skip_space(ptr, end);
+        if (ptr == end) {return false;}
+        switch (*ptr) {
+        case '{': {
+            value.m_type = Object;
+            ptr++;
+            skip_space(ptr, end);
+            if (ptr < end && *ptr == '}') {ptr++; return true;}
+            while (true) {
+                std::string key;
+                skip_space(ptr, end);
+                if (!parse_string(ptr, end, key)) {return false;}
+                skip_space(ptr, end);
+                if (ptr == end || *ptr++ != ':') {return false;}
+                value.m_object.emplace_back(std::move(key), SciTokensJson());
+                if (!parse_value(ptr, end, value.m_object.back().second, depth + 1)) {return false;}
+                skip_space(ptr, end);
+                if (ptr == end) {return false;}
+                if (*ptr == '}') {ptr++; return true;}
+                if (*ptr++ != ',') {return false;}
+            }
+        }
+        case '[': {
+            value.m_type = Array;
+            ptr++;
+            skip_space(ptr, end);
+            if (ptr < end && *ptr == ']') {ptr++; return true;}
+            while (true) {
+                value.m_array.emplace_back();
+                if (!parse_value(ptr, end, value.m_array.back(), depth + 1)) {return false;}
+                skip_space(ptr, end);
+                if (ptr == end) {return false;}
+                if (*ptr == ']') {ptr++; return true;}
+                if (*ptr++ != ',') {return false;}
+            }
+        }
+        case '"':
+            value.m_type = String;
+            return parse_string(ptr, end, value.m_string);
+        case 't':
+            value.m_type = Bool;
+            value.m_bool = true;
+            return parse_literal(ptr, end, "true");
+        case 'f':
+            value.m_type = Bool;
+            return parse_literal(ptr, end, "false");
+        case 'n':
+            return parse_literal(ptr, end, "null");
+        default: {
+            const char *start = ptr;
+            if (ptr < end && *ptr == '-') {ptr++;}
+            while (ptr < end && ((*ptr >= '0' && *ptr <= '9') || *ptr == '.' || *ptr == 'e' || *ptr == 'E' ||
+                                 *ptr == '+' || *ptr == '-')) {
+                ptr++;
+            }
+            if (ptr == start) {return false;}
+            std::string number(start, ptr);
+            char *number_end;
+            value.m_type = Number;
+            value.m_number = strtod(number.c_str(), &number_end);
+            return *number_end == '\0';
+        }
+        }
+    }
+
+    static void append_utf8(unsigned codepoint, std::string &out) {
+        if (codepoint < 0x80) {
+            out.push_back(static_cast<char>(codepoint));
+        } else if (codepoint < 0x800) {
+            out.push_back(static_cast<char>(0xc0 | (codepoint >> 6)));
+            out.push_back(static_cast<char>(0x80 | (codepoint & 0x3f)));
+        } else if (codepoint < 0x10000) {
+            out.push_back(static_cast<char>(0xe0 | (codepoint >> 12)));
+            out.push_back(static_cast<char>(0x80 | ((codepoint >> 6) & 0x3f)));
+            out.push_back(static_cast<char>(0x80 | (codepoint & 0x3f)));
+        } else {
+            out.push_back(static_cast<char>(0xf0 | (codepoint >> 18)));
+            out.push_back(static_cast<char>(0x80 | ((codepoint >> 12) & 0x3f)));
+            out.push_back(static_cast<char>(0x80 | ((codepoint >> 6) & 0x3f)));
+            out.push_back(static_cast<char>(0x80 | (codepoint & 0x3f)));
+        }
+    }
+
+    static bool parse_hex4(const char *&ptr, const char *end, unsigned &value) {
+        if (end - ptr < 4) {return false;}
+        value = 0;
+        for (int idx = 0; idx < 4; idx++, ptr++) {
+            char c = *ptr;
+            value <<= 4;
+            if (c >= '0' && c <= '9') {value |= c - '0';}
+            else if (c >= 'a' && c <= 'f') {value |= c - 'a' + 10;}
+            else if (c >= 'A' && c <= 'F') {value |= c - 'A' + 10;}
+            else {return false;}
+        }
+        return true;
+    }
+
+    static bool parse_string(const char *&ptr, const char *end, std::string &out) {
+        if (ptr == end || *ptr++ != '"') {return false;}
+        while (ptr < end) {
+            char c = *ptr++;
+            if (c == '"') {return true;}
+            if (static_cast<unsigned char>(c) < 0x20) {return false;}
+            if (c != '\\') {
+                out.push_back(c);
+                continue;
+            }
+            if (ptr == end) {return false;}
+            switch (c = *ptr++) {
+            case '"': case '\\': case '/': out.push_back(c); break;
+            case 'b': out.push_back('\b'); break;
+            case 'f': out.push_back('\f'); break;
+            case 'n': out.push_back('\n'); break;
+            case 'r': out.push_back('\r'); break;
+            case 't': out.push_back('\t'); break;
+            case 'u': {
+                unsigned codepoint;
+                if (!parse_hex4(ptr, end, codepoint)) {return false;}
+                if (codepoint >= 0xd800 && codepoint < 0xdc00) {
+                    unsigned low;
+                    if (end - ptr < 2 || ptr[0] != '\\' || ptr[1] != 'u') {return false;}
+                    ptr += 2;
+                    if (!parse_hex4(ptr, end, low) || low < 0xdc00 || low >= 0xe000) {return false;}
+                    codepoint = 0x10000 + ((codepoint - 0xd800) << 10) + (low - 0xdc00);
+                } else if (codepoint >= 0xdc00 && codepoint < 0xe000) {
+                    return false;
+                }
+                append_utf8(codepoint, out);
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+        return false;
+    }
+};
+
+#endif  // SCITOKENS_PARSE_H
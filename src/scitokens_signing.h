@@ -0,0 +1,118 @@
+// Helpers generating keys and signing tokens for the programs exercising the
+// native validator (the PGO workload and the core benchmarks).
+
+#ifndef SCITOKENS_SIGNING_H
+#define SCITOKENS_SIGNING_H
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/obj_mac.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+
+#include <cstdio>
+#include <string>
+
+
+static inline std::string Base64UrlEncode(const std::string &input)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    std::string output;
+    unsigned accumulator = 0;
+    int bits = 0;
+    for (unsigned char c : input) {
+        accumulator = (accumulator << 8) | c;
+        bits += 8;
+        while (bits >= 6) {
+            bits -= 6;
+            output.push_back(alphabet[(accumulator >> bits) & 0x3f]);
+        }
+    }
+    if (bits) {output.push_back(alphabet[(accumulator << (6 - bits)) & 0x3f]);}
+    return output;
+}
+
+
+static inline EVP_PKEY *GenerateKey(int type)
+{
+    EVP_PKEY *key = nullptr;
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(type, nullptr);
+    if (ctx && EVP_PKEY_keygen_init(ctx) == 1 &&
+        (type == EVP_PKEY_RSA ? EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048) :
+         type == EVP_PKEY_EC ? EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) : 1) == 1) {
+        EVP_PKEY_keygen(ctx, &key);
+    }
+    EVP_PKEY_CTX_free(ctx);
+    return key;
+}
+
+
+static inline bool WritePublicKey(EVP_PKEY *key, const std::string &fname)
+{
+    FILE *fp = fopen(fname.c_str(), "w");
+    if (!fp) {return false;}
+    bool success = PEM_write_PUBKEY(fp, key) == 1;
+    return (fclose(fp) == 0) && success;
+}
+
+
+// Sign `input` as OpenSSL encodes signatures: PKCS #1 for RSA, a DER
+// ECDSA-Sig-Value for EC (both over the SHA-256 digest), raw for Ed25519.
+static inline std::string Sign(EVP_PKEY *key, const std::string &input)
+{
+    std::string signature(EVP_PKEY_size(key), '\0');
+    size_t len = signature.size();
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+#ifdef EVP_PKEY_ED25519
+    if (EVP_PKEY_base_id(key) == EVP_PKEY_ED25519) {
+        if (!ctx || EVP_DigestSignInit(ctx, nullptr, nullptr, nullptr, key) != 1 ||
+            EVP_DigestSign(ctx, reinterpret_cast<unsigned char *>(&signature[0]), &len,
+                           reinterpret_cast<const unsigned char *>(input.data()), input.size()) != 1) {
+            len = 0;
+        }
+        EVP_MD_CTX_free(ctx);
+        signature.resize(len);
+        return signature;
+    }
+#endif
+    if (!ctx || EVP_DigestSignInit(ctx, nullptr, EVP_sha256(), nullptr, key) != 1 ||
+        EVP_DigestSignUpdate(ctx, input.data(), input.size()) != 1 ||
+        EVP_DigestSignFinal(ctx, reinterpret_cast<unsigned char *>(&signature[0]), &len) != 1) {
+        len = 0;
+    }
+    EVP_MD_CTX_free(ctx);
+    signature.resize(len);
+    return signature;
+}
+
+
+// Serialize and sign a token with the given claims (RS256 for RSA keys,
+// ES256 for EC keys, EdDSA for Ed25519 keys).
+static inline std::string SignToken(EVP_PKEY *key, const std::string &claims)
+{
+    int type = EVP_PKEY_base_id(key);
+    bool ec = type == EVP_PKEY_EC;
+    const char *alg = ec ? "ES256" : (type == EVP_PKEY_RSA) ? "RS256" : "EdDSA";
+    std::string input = Base64UrlEncode("{\"alg\":\"" + std::string(alg) + "\",\"typ\":\"JWT\"}") + "." +
+                        Base64UrlEncode(claims);
+    std::string signature = Sign(key, input);
+    if (signature.empty()) {return "";}
+    if (ec) {
+        // Convert the DER-encoded ECDSA-Sig-Value into the raw r || s of JWS.
+        const unsigned char *der = reinterpret_cast<const unsigned char *>(signature.data());
+        ECDSA_SIG *ec_sig = d2i_ECDSA_SIG(nullptr, &der, signature.size());
+        if (!ec_sig) {return "";}
+        const BIGNUM *r, *s;
+        ECDSA_SIG_get0(ec_sig, &r, &s);
+        std::string raw(64, '\0');
+        BN_bn2binpad(r, reinterpret_cast<unsigned char *>(&raw[0]), 32);
+        BN_bn2binpad(s, reinterpret_cast<unsigned char *>(&raw[32]), 32);
+        ECDSA_SIG_free(ec_sig);
+        signature = raw;
+    }
+    return "Bearer%20" + input + "." + Base64UrlEncode(signature);
+}
+
+#endif
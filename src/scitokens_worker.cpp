@@ -0,0 +1,20 @@
+// The worker process of the `worker` validation engine: validates the tokens
+// sent by the plugin on its standard input with the native validator and
+// replies on its standard output.  Started by the plugin as
+//
+//   xrootd-scitokens-worker /etc/xrootd/scitokens.cfg
+
+#include "scitokens_core.h"
+
+#include <cstdio>
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s CONFIG_FILE\n", argv[0]);
+        return 1;
+    }
+    SciTokensStderrLog log;
+    // Requests and replies share the socket on the standard input and output.
+    return SciTokensWorkerValidator::Serve(0, argv[1], log);
+}
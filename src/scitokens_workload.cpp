@@ -0,0 +1,362 @@
+// A representative authorization workload for the SciTokens plugin.  It trains
+// the profile of the SCITOKENS_PGO build and reports the per-request cost of
+// each scenario for one or more builds or configurations of the plugin:
+//
+//   scitokens-workload libXrdAccSciTokens-baseline.so libXrdAccSciTokens-4.so
+//   scitokens-workload "libXrdAccSciTokens-4.so engine=python" "libXrdAccSciTokens-4.so engine=native"
+//
+// Parameters following a plugin's path are passed to it after `config=`.
+// Each plugin's time-to-first-request is measured first, in a fresh process:
+// loading and initializing the plugin, then authorizing a request whose token
+// must be validated.  Tokens are signed with keys generated on the fly, so the
+// scenarios are only run for plugins validating natively.
+
+#include "XrdAcc/XrdAccAuthorize.hh"
+#include "XrdOuc/XrdOucEnv.hh"
+#include "XrdSec/XrdSecEntity.hh"
+#include "XrdSys/XrdSysLogger.hh"
+
+#include "scitokens_signing.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef XrdAccAuthorize *(*XrdAccAuthorizeObject_t)(XrdSysLogger *lp, const char *cfn, const char *parm);
+
+static const char *g_rsa_issuer = "https://rsa.workload.example";
+static const char *g_ec_issuer = "https://ec.workload.example";
+
+// The number of requests issued by each scenario.
+static const size_t g_requests = 200000;
+// The number of distinct clients, each with its own token.
+static const size_t g_clients = 64;
+// The number of previously unseen tokens validated by the cache-miss scenario.
+static const size_t g_fresh_tokens = 1000;
+// Scenarios served from the caches are repeated; the fastest round is reported.
+static const int g_rounds = 3;
+
+
+// The tokens of the workload, mixing the ways authorizations are expressed:
+// `authz`/`path` claims, WLCG scopes (with globs), and group membership.
+class TokenFactory
+{
+public:
+    TokenFactory(EVP_PKEY *rsa, EVP_PKEY *ec) : m_rsa(rsa), m_ec(ec), m_exp(time(nullptr) + 3600) {}
+
+    std::string make(size_t idx)
+    {
+        std::string common = "\"exp\":" + std::to_string(m_exp) + ",\"iat\":" + std::to_string(m_exp - 3600) +
+                             ",\"jti\":\"" + std::to_string(idx) + "\"";
+        std::string user = "user" + std::to_string(idx % 97);
+        switch (idx % 3) {
+        case 0:
+            return SignToken(m_rsa, "{\"iss\":\"" + std::string(g_rsa_issuer) + "\",\"sub\":\"" + user + "\"," + common +
+                                    ",\"authz\":[\"read\",\"write\"],\"path\":[\"/home/" + user + "\",\"/public\"]}");
+        case 1:
+            return SignToken(m_ec, "{\"iss\":\"" + std::string(g_ec_issuer) + "\",\"sub\":\"" + user + "\"," + common +
+                                   ",\"scope\":\"openid storage.read:/ storage.modify:/home/" + user +
+                                   " storage.create:/runs/run-* storage.modify:/protected\"}");
+        default:
+            return SignToken(m_ec, "{\"iss\":\"" + std::string(g_ec_issuer) + "\",\"sub\":\"" + user + "\"," + common +
+                                   ",\"scope\":\"storage.read:/home/" + user + "\",\"wlcg.groups\":[\"/cms\",\"/cms/production\"]}");
+        }
+    }
+
+private:
+    EVP_PKEY *m_rsa;
+    EVP_PKEY *m_ec;
+    long m_exp;
+};
+
+
+// A request of the workload; the path is usually, but not always, authorized.
+struct Request
+{
+    size_t m_client;
+    size_t m_token;
+    Access_Operation m_oper;
+    std::string m_path;
+};
+
+
+static std::vector<Request> MakeRequests(size_t count, size_t clients, size_t tokens, double rebind_fraction,
+                                         std::mt19937 &rng)
+{
+    static const Access_Operation opers[] = {AOP_Read, AOP_Read, AOP_Read, AOP_Stat, AOP_Update, AOP_Create,
+                                             AOP_Mkdir, AOP_Delete, AOP_Readdir};
+    static const char *prefixes[] = {"/rsa/home/user", "/rsa/public", "/ec/home/user", "/ec/runs/run-",
+                                     "/ec/protected/user", "/store/cms/production/user", "/elsewhere/user"};
+    std::uniform_real_distribution<double> fraction(0, 1);
+    std::vector<Request> requests;
+    requests.reserve(count);
+    for (size_t idx = 0; idx < count; idx++) {
+        Request request;
+        request.m_client = rng() % clients;
+        request.m_token = (fraction(rng) < rebind_fraction) ? rng() % tokens : request.m_client % tokens;
+        request.m_oper = opers[rng() % (sizeof(opers) / sizeof(opers[0]))];
+        request.m_path = std::string(prefixes[rng() % (sizeof(prefixes) / sizeof(prefixes[0]))]) +
+                         std::to_string(request.m_token % 97) + "/file" + std::to_string(rng() % 1000);
+        requests.push_back(std::move(request));
+    }
+    return requests;
+}
+
+
+static double ElapsedMs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+// Load and initialize the plugin of `spec`, a path optionally followed by
+// parameters; returns nullptr after printing the error on failure.
+static XrdAccAuthorize *LoadPlugin(const std::string &spec, const std::string &config, XrdSysLogger &logger)
+{
+    size_t pos = spec.find(' ');
+    std::string path = spec.substr(0, pos);
+    std::string parms = "config=" + config + (pos == std::string::npos ? "" : spec.substr(pos));
+    void *handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    XrdAccAuthorizeObject_t factory_fn = handle ?
+        reinterpret_cast<XrdAccAuthorizeObject_t>(dlsym(handle, "XrdAccAuthorizeObject")) : nullptr;
+    if (!factory_fn) {
+        fprintf(stderr, "Unable to load plugin %s: %s\n", path.c_str(), dlerror());
+        return nullptr;
+    }
+    XrdAccAuthorize *authz = factory_fn(&logger, nullptr, parms.c_str());
+    if (!authz) {
+        fprintf(stderr, "Unable to initialize plugin %s\n", spec.c_str());
+    }
+    return authz;
+}
+
+
+// The time-to-first-request of a plugin, in milliseconds since loading began.
+struct ColdStart
+{
+    double m_startup;
+    double m_first_request;
+    int m_authorized;
+};
+
+
+// Measure the cold start of the plugin of `spec` in a child process, so that
+// neither the plugin nor its dependencies (e.g., python) are loaded yet.
+static bool MeasureColdStart(const std::string &spec, const std::string &config, const std::string &token,
+                             const char *path, ColdStart &result)
+{
+    int fds[2];
+    if (pipe(fds)) {
+        perror("Unable to create a pipe");
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Unable to fork");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        ColdStart child{-1, -1, 0};
+        XrdSysLogger logger;
+        auto start = std::chrono::steady_clock::now();
+        XrdAccAuthorize *authz = LoadPlugin(spec, config, logger);
+        if (authz) {
+            child.m_startup = ElapsedMs(start);
+            XrdSecEntity client("https");
+            XrdOucEnv env;
+            env.Put("authz", token.c_str());
+            XrdAccPrivs privs = authz->Access(&client, path, AOP_Read, &env);
+            child.m_first_request = ElapsedMs(start);
+            child.m_authorized = authz->Test(privs, AOP_Read);
+        }
+        ssize_t written = write(fds[1], &child, sizeof(child));
+        _exit(written == sizeof(child) ? 0 : 1);
+    }
+    close(fds[1]);
+    bool received = read(fds[0], &result, sizeof(result)) == sizeof(result);
+    close(fds[0]);
+    waitpid(pid, nullptr, 0);
+    return received && result.m_startup >= 0;
+}
+
+
+// Print a row of results, with the speedup of the last plugin over the first.
+static void PrintRow(const char *name, const std::vector<double> &values)
+{
+    printf("%-16s", name);
+    for (const auto value : values) {
+        if (value >= 0) {
+            printf(" %32.1f", value);
+        } else {
+            printf(" %32s", "-");
+        }
+    }
+    if (values.size() > 1 && values.front() >= 0 && values.back() > 0) {
+        printf("  %6.2fx", values.front() / values.back());
+    }
+    printf("\n");
+}
+
+
+// Issue the requests and return the mean cost per request, in nanoseconds.
+static double Run(XrdAccAuthorize &authz, std::vector<std::unique_ptr<XrdSecEntity>> &clients,
+                  const std::vector<std::string> &tokens, const std::vector<Request> &requests, size_t &granted)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (const auto &request : requests) {
+        XrdOucEnv env;
+        env.Put("authz", tokens[request.m_token].c_str());
+        XrdAccPrivs privs = authz.Access(clients[request.m_client].get(), request.m_path.c_str(), request.m_oper, &env);
+        granted += authz.Test(privs, request.m_oper);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / requests.size();
+}
+
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s \"PLUGIN [PARAMETER ...]\" [...]\n", argv[0]);
+        return 1;
+    }
+
+    char dir_template[] = "/tmp/scitokens-workload.XXXXXX";
+    if (!mkdtemp(dir_template)) {
+        perror("Unable to create the workload directory");
+        return 1;
+    }
+    std::string dir(dir_template);
+    EVP_PKEY *rsa = GenerateKey(EVP_PKEY_RSA);
+    EVP_PKEY *ec = GenerateKey(EVP_PKEY_EC);
+    if (!rsa || !ec || !WritePublicKey(rsa, dir + "/rsa.pem") || !WritePublicKey(ec, dir + "/ec.pem")) {
+        fprintf(stderr, "Unable to generate the workload keys\n");
+        return 1;
+    }
+    std::string config = dir + "/scitokens.cfg";
+    FILE *fp = fopen(config.c_str(), "w");
+    if (!fp) {
+        perror("Unable to write the workload configuration");
+        return 1;
+    }
+    fprintf(fp, "[Issuer RSA]\nissuer = %s\nbase_path = /rsa\nmap_subject = true\npublic_key_file = %s/rsa.pem\n\n"
+                "[Issuer EC]\nissuer = %s\nbase_path = /ec\ndeny = storage.modify:/protected\n"
+                "public_key_file = %s/ec.pem\n\n"
+                "[Group CMS]\nissuer = %s\ngroup = /cms/production\npath = /store/cms/production\nauthz = read, write\n",
+            g_rsa_issuer, dir.c_str(), g_ec_issuer, dir.c_str(), g_ec_issuer);
+    fclose(fp);
+
+    TokenFactory factory(rsa, ec);
+    std::vector<std::string> tokens, fresh_tokens;
+    for (size_t idx = 0; idx < g_clients; idx++) {
+        tokens.push_back(factory.make(idx));
+    }
+    for (size_t idx = 0; idx < g_fresh_tokens; idx++) {
+        fresh_tokens.push_back(factory.make(g_clients + idx));
+    }
+
+    // Scenarios: each client keeps presenting its token (session hits);
+    // clients switch between known tokens (token cache hits); every request
+    // brings a new token (validation); and a mix of the three.
+    std::mt19937 rng(20171020);
+    struct Scenario {
+        const char *m_name;
+        const std::vector<std::string> *m_tokens;
+        std::vector<Request> m_requests;
+        int m_rounds;
+    } scenarios[] = {
+        {"session hit", &tokens, MakeRequests(g_requests, g_clients, g_clients, 0, rng), g_rounds},
+        {"token cache hit", &tokens, MakeRequests(g_requests, g_clients, g_clients, 1, rng), g_rounds},
+        {"validation", &fresh_tokens, MakeRequests(g_fresh_tokens, g_clients, g_fresh_tokens, 1, rng), 1},
+        {"mixed", &tokens, MakeRequests(g_requests, g_clients, g_clients, 0.1, rng), g_rounds},
+    };
+    for (size_t idx = 0; idx < g_fresh_tokens; idx++) {
+        scenarios[2].m_requests[idx].m_token = idx;
+    }
+
+    // The cold starts are measured before any plugin is loaded here.
+    std::string first_token = factory.make(3 * (g_clients + g_fresh_tokens));
+    std::vector<ColdStart> cold_starts(argc - 1);
+    for (int plugin = 1; plugin < argc; plugin++) {
+        if (!MeasureColdStart(argv[plugin], config, first_token, "/rsa/public/file", cold_starts[plugin - 1])) {
+            fprintf(stderr, "Unable to measure the cold start of plugin %s\n", argv[plugin]);
+            return 1;
+        }
+    }
+
+    XrdSysLogger logger;
+    std::vector<std::vector<double>> results(argc - 1);
+    for (int plugin = 1; plugin < argc; plugin++) {
+        if (!cold_starts[plugin - 1].m_authorized) {
+            fprintf(stderr, "Plugin %s denied a valid token; is it validating natively?  Skipping its scenarios.\n",
+                    argv[plugin]);
+            results[plugin - 1].assign(sizeof(scenarios) / sizeof(scenarios[0]), -1);
+            continue;
+        }
+        std::unique_ptr<XrdAccAuthorize> authz(LoadPlugin(argv[plugin], config, logger));
+        if (!authz) {
+            return 1;
+        }
+        std::vector<std::unique_ptr<XrdSecEntity>> clients;
+        for (size_t idx = 0; idx < g_clients; idx++) {
+            clients.emplace_back(new XrdSecEntity("https"));
+        }
+        size_t granted = 0;
+        for (auto &scenario : scenarios) {
+            double best = Run(*authz, clients, *scenario.m_tokens, scenario.m_requests, granted);
+            for (int round = 1; round < scenario.m_rounds; round++) {
+                best = std::min(best, Run(*authz, clients, *scenario.m_tokens, scenario.m_requests, granted));
+            }
+            results[plugin - 1].push_back(best);
+        }
+        if (!granted) {
+            fprintf(stderr, "Plugin %s did not authorize any request; is it built with the native validator?\n",
+                    argv[plugin]);
+            return 1;
+        }
+    }
+
+    printf("%-16s", "scenario (ns)");
+    for (int plugin = 1; plugin < argc; plugin++) {
+        const char *name = strrchr(argv[plugin], '/');
+        printf(" %32.32s", name ? name + 1 : argv[plugin]);
+    }
+    printf(argc > 2 ? "  speedup\n" : "\n");
+    for (size_t idx = 0; idx < sizeof(scenarios) / sizeof(scenarios[0]); idx++) {
+        std::vector<double> row;
+        for (const auto &result : results) {
+            row.push_back(result[idx]);
+        }
+        PrintRow(scenarios[idx].m_name, row);
+    }
+    printf("%-16s\n", "cold start (ms)");
+    std::vector<double> startup, first_request;
+    for (const auto &cold_start : cold_starts) {
+        startup.push_back(cold_start.m_startup);
+        first_request.push_back(cold_start.m_first_request);
+    }
+    PrintRow("startup", startup);
+    PrintRow("first request", first_request);
+
+    for (const char *fname : {"/rsa.pem", "/ec.pem", "/scitokens.cfg"}) {
+        unlink((dir + fname).c_str());
+    }
+    rmdir(dir.c_str());
+    EVP_PKEY_free(rsa);
+    EVP_PKEY_free(ec);
+    return 0;
+}
@@ -1,14 +1,38 @@
 
-import ConfigParser
-import errno
 import os
+import threading
 import time
+import traceback
 import urllib
 
 import scitokens
 import _scitokens_xrootd
 
+# Issuer table provided by the plugin, which parses the configuration file.
 g_authorized_issuers = {}
+# Prebuilt IssuerValidator objects, keyed by issuer.
+g_issuer_validators = {}
+# The AclGenerator of the validation in progress on each thread.
+g_call_state = threading.local()
+# Compiled `scope` claims, keyed by (scope, base_path); shared by all tokens
+# carrying the same set of scopes.
+g_scope_cache = {}
+g_scope_cache_max = 1024
+
+# Access operations granted by each WLCG storage scope.
+g_scope_aops = {
+    "storage.read": [_scitokens_xrootd.AccessOperation.Read],
+    "storage.create": [_scitokens_xrootd.AccessOperation.Create,
+                       _scitokens_xrootd.AccessOperation.Mkdir],
+    "storage.modify": [_scitokens_xrootd.AccessOperation.Create,
+                       _scitokens_xrootd.AccessOperation.Mkdir,
+                       _scitokens_xrootd.AccessOperation.Update,
+                       _scitokens_xrootd.AccessOperation.Delete,
+                       _scitokens_xrootd.AccessOperation.Rename],
+}
+
+# Tolerated clock skew, in seconds, for the `iat` and `nbf` claims.
+g_clock_skew = 60
 
 class InvalidAuthorization(object):
     """
@@ -17,6 +41,11 @@ class InvalidAuthorization(object):
     """
 
 class AclGenerator(object):
+    """
+    Per-call state accumulated while validating the claims of one token.
+    """
+
+    __slots__ = ["aops", "paths", "cache_expiry", "subject", "base_path", "issuer", "groups", "scope_acls"]
 
     def __init__(self, base_path="/"):
         self.aops = set()
@@ -25,6 +54,8 @@ class AclGenerator(object):
         self.subject = ""
         self.base_path = base_path
         self.issuer = None
+        self.groups = []
+        self.scope_acls = ()
 
     def validate_authz(self, values):
         if isinstance(values, str) or isinstance(values, unicode):
@@ -48,6 +79,19 @@ class AclGenerator(object):
             self.paths.add(scitokens.urltools.normalize_path(value))
         return True
 
+    def validate_scope(self, value):
+        key = (value, self.base_path)
+        acls = g_scope_cache.get(key)
+        if acls is None:
+            acls = compile_scope(value, self.base_path)
+            if acls is None:
+                return False
+            if len(g_scope_cache) >= g_scope_cache_max:
+                g_scope_cache.clear()
+            g_scope_cache[key] = acls
+        self.scope_acls = acls
+        return True
+
     def validate_exp(self, value):
         self.cache_expiry = value - time.time()
         if self.cache_expiry <= 0:
@@ -58,12 +102,21 @@ class AclGenerator(object):
         self.subject = value
         return True
 
+    def validate_groups(self, values):
+        if isinstance(values, str) or isinstance(values, unicode):
+            values = [values]
+        self.groups = [str(value) for value in values]
+        return True
+
     def validate_iss(self, value):
         self.issuer = value
         return True
 
     def validate_iat(self, value):
-        return time.time() > int(value)
+        return time.time() + g_clock_skew > int(value)
+
+    def validate_nbf(self, value):
+        return time.time() + g_clock_skew >= int(value)
 
     def generate_acls(self):
         if self.aops and not self.paths:
@@ -72,63 +125,112 @@ class AclGenerator(object):
         for aop in self.aops:
             for path in self.paths:
                 # Note that in validate_path we verified `path` starts with '/'
-                path = str(os.path.normpath(self.base_path + path))
-                while path.startswith("//"):
-                    path = path[1:]
-                yield (aop, path)
+                yield (aop, join_base_path(self.base_path, path))
+        for acl in self.scope_acls:
+            yield acl
 
 
-def config(fname):
-    print "Trying to load configuration from %s" % fname
-    cp = ConfigParser.SafeConfigParser()
-    try:
-        with open(fname, "r") as fp:
-            cp.readfp(fp)
-    except IOError as ie:
-        if ie.errno == errno.ENOENT:
-            return
-        raise
-    for section in cp.sections():
-        if not section.lower().startswith("issuer "):
+def join_base_path(base_path, path):
+    """
+    Join an absolute token path onto the issuer's base path.
+    """
+    path = str(os.path.normpath(base_path + path))
+    while path.startswith("//"):
+        path = path[1:]
+    return path
+
+
+def compile_scope(scope, base_path):
+    """
+    Compile a WLCG `scope` claim (e.g., "storage.read:/data storage.modify:/data/user")
+    into a tuple of (aop, path) ACLs.  Scopes not concerning storage are ignored;
+    returns None if a storage scope is malformed.
+    """
+    acls = set()
+    for entry in scope.split():
+        authz, _, path = entry.partition(":")
+        aops = g_scope_aops.get(authz)
+        if aops is None:
             continue
-        if 'issuer' not in cp.options(section):
-            print "Ignoring section %s as it has no `issuer` option set." % section
-        if 'base_path' not in cp.options(section):
-            print "Ignoring section %s as it has no `base_path` option set." % section
-        issuer = cp.get(section, 'issuer')
-        base_path = cp.get(section, 'base_path')
-        base_path = scitokens.urltools.normalize_path(base_path)
-        issuer_info = g_authorized_issuers.setdefault(issuer, {})
-        issuer_info['base_path'] = base_path
-        if 'map_subject' in cp.options(section):
-            issuer_info['map_subject'] = cp.getboolean(section, 'map_subject')
-        print "Configured token access for %s (issuer %s): %s" % (section, issuer, str(issuer_info))
-
-def init(parms=None):
-    print "SciTokens module configuration parameters:", parms
-    found_config = False
-
-    if parms:
-        for parm in parms.split():
-            info = parm.split('=', 2)
-            if len(info) != 2:
-               print "Ignoring unknown parameter:", parm
-               continue
-            key, val = info
-            if key == "config":
-                config(val)
-                found_config = True
-    if not found_config:
-        config("/etc/xrootd/scitokens.cfg")
+        if not path:
+            path = "/"
+        if not path.startswith("/"):
+            return None
+        path = join_base_path(base_path, scitokens.urltools.normalize_path(path))
+        for aop in aops:
+            acls.add((aop, path))
+    return tuple(acls)
+
+
+class IssuerValidator(object):
+    """
+    The scitokens.Validator for one issuer, built once at init().  Its claim
+    validators dispatch to the AclGenerator of the validation in progress on
+    the calling thread, so no per-token setup is needed.
+    """
+
+    claim_handlers = [
+        ("authz", AclGenerator.validate_authz),
+        ("path", AclGenerator.validate_path),
+        ("exp", AclGenerator.validate_exp),
+        ("sub", AclGenerator.validate_sub),
+        ("iss", AclGenerator.validate_iss),
+        ("wlcg.groups", AclGenerator.validate_groups),
+        ("scope", AclGenerator.validate_scope),
+        ("iat", AclGenerator.validate_iat),
+        ("nbf", AclGenerator.validate_nbf),
+    ]
+
+    def __init__(self, issuer, info):
+        self.issuer = issuer
+        self.base_path = info['base_path']
+        self.map_subject = info.get('map_subject', False)
+        self.validator = scitokens.Validator()
+        for claim, handler in self.claim_handlers:
+            self.validator.add_validator(claim, self._dispatch(handler))
+
+    @staticmethod
+    def _dispatch(handler):
+        def validate(value):
+            return handler(g_call_state.generator, value)
+        return validate
+
+    def validate(self, scitoken):
+        ag = AclGenerator(self.base_path)
+        g_call_state.generator = ag
+        try:
+            self.validator.validate(scitoken)
+        finally:
+            g_call_state.generator = None
+        return ag
+
+
+def init(issuers):
+    """
+    Initialize the module with the issuer table parsed by the plugin from
+    scitokens.cfg: a dict mapping each issuer to its `base_path` and
+    `map_subject` settings.
+    """
+    g_authorized_issuers.clear()
+    g_issuer_validators.clear()
+    for issuer, info in issuers.items():
+        g_authorized_issuers[issuer] = dict(info)
+        g_issuer_validators[issuer] = IssuerValidator(issuer, g_authorized_issuers[issuer])
+        print "Configured token access for issuer %s: %s" % (issuer, str(g_authorized_issuers[issuer]))
 
 
 def generate_acls(header):
     """
     Generate a list of ACLs and the ACL timeut
+
+    Returns a tuple (cache_expiry, acls, username, issuer, subject, groups);
+    the claims are returned so the caller can export them without parsing
+    the token again.
     """
-    orig_header = urllib.unquote(header)
+    # Most headers are not percent-encoded; skip the unquoting when possible.
+    orig_header = urllib.unquote(header) if '%' in header else header
     if not orig_header.startswith("Bearer "):
-        return 60, [], ""
+        return 60, [], "", "", "", []
     token = orig_header[7:]
     try:
         scitoken = scitokens.SciToken.deserialize(token)
@@ -140,24 +242,32 @@ def generate_acls(header):
 
     claims = dict(scitoken.claims())
     issuer = claims['iss']
-    if issuer not in g_authorized_issuers:
+    issuer_validator = g_issuer_validators.get(issuer)
+    if issuer_validator is None:
         print "Token issuer (%s) not configured." % issuer
-        return 60, [], ""
-    base_path = g_authorized_issuers[issuer]['base_path']
-
-    ag = AclGenerator(base_path)
+        return 60, [], "", "", "", []
 
-    validator = scitokens.Validator()
-    validator.add_validator("authz", ag.validate_authz)
-    validator.add_validator("path", ag.validate_path)
-    validator.add_validator("exp", ag.validate_exp)
-    validator.add_validator("sub", ag.validate_sub)
-    validator.add_validator("iss", ag.validate_iss)
-    validator.add_validator("iat", ag.validate_iss)
-    validator.add_validator("nbf", ag.validate_iss)
-    validator.validate(scitoken)
+    ag = issuer_validator.validate(scitoken)
 
     subject = ""
-    if g_authorized_issuers[issuer].get('map_subject'):
+    if issuer_validator.map_subject:
         subject = ag.subject
-    return int(ag.cache_expiry), list(ag.generate_acls()), str(subject)
+    return int(ag.cache_expiry), list(ag.generate_acls()), str(subject), str(issuer), str(ag.subject), ag.groups
+
+
+def generate_acls_batch(headers):
+    """
+    Validate a list of authorization headers in one call, so the plugin
+    enters python once for all of them.
+
+    Returns a list holding, for each header, the tuple returned by
+    generate_acls() or, if the token is invalid, a string describing the
+    error.
+    """
+    results = []
+    for header in headers:
+        try:
+            results.append(generate_acls(header))
+        except Exception:
+            results.append(traceback.format_exc())
+    return results